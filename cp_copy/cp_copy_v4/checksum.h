@@ -0,0 +1,333 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// checksums computed while the data is in the copy buffer, used by
+// copy_engine.h
+//
+// Two checksums are offered:
+//   crc32c - the Castagnoli CRC, which SSE4.2 computes 8 bytes per
+//            instruction; a table-driven version is used on other CPUs.
+//   xxh64  - xxHash64, which mixes four independent 64-bit lanes and is
+//            fast on any 64-bit CPU.
+// Data must be fed in file order. Holes the copy skips are fed as zeros,
+// so the checksum is the same however the file was copied.
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+
+#define ZERO_FEED_SIZE (64 * 1024) // zeros fed per call for a hole
+
+typedef enum _checksum_type {
+  CHECKSUM_NONE,
+  CHECKSUM_CRC32C,
+  CHECKSUM_XXH64
+} checksum_type;
+
+typedef struct _checksum {
+  checksum_type type;
+  off_t offset; // bytes fed so far, the next offset expected
+  uint32_t crc; // crc32c state
+  uint64_t lanes[4]; // xxh64 accumulators
+  unsigned char stripe[32]; // xxh64 input not yet a full stripe
+  size_t stripe_length;
+} checksum;
+
+static const uint64_t XXH_PRIME_1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME_2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME_3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME_4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME_5 = 2870177450012600261ULL;
+
+static uint32_t crc32c_table[256]; // filled once, by crc32c_table_init()
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Converts the argument of --checksum to a checksum_type
+ * @return: the type or -1 if the name is unknown
+ */
+static inline int checksum_from_name(const char *name) {
+  if (strcmp(name, "crc32c") == 0) {
+    return CHECKSUM_CRC32C;
+  } else if (strcmp(name, "xxh64") == 0 || strcmp(name, "xxhash") == 0) {
+    return CHECKSUM_XXH64;
+  } else if (strcmp(name, "none") == 0) {
+    return CHECKSUM_NONE;
+  }
+
+  return -1;
+}
+
+/**
+ * Fills crc32c_table with the CRC of every byte value (reflected polynomial
+ * 0x82F63B78); run through pthread_once(), as threads copy files at once
+ */
+static void crc32c_table_init(void) {
+  uint32_t value;
+  int bit;
+  int i;
+
+  for (i = 0; i < 256; i++) {
+    value = i;
+    for (bit = 0; bit < 8; bit++) {
+      value = (value & 1) ? (value >> 1) ^ 0x82F63B78 : value >> 1;
+    }
+    crc32c_table[i] = value;
+  }
+}
+
+/**
+ * crc32c one byte at a time, with a table of the CRC of every byte value
+ * (reflected polynomial 0x82F63B78)
+ */
+static inline uint32_t crc32c_table_update(uint32_t crc,
+                                           const unsigned char *data,
+                                           size_t length) {
+  pthread_once(&crc32c_table_once, crc32c_table_init);
+
+  while (length--) {
+    crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * crc32c with the SSE4.2 crc32 instruction, 8 bytes at a time
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_update(uint32_t crc, const unsigned char *data,
+                                    size_t length) {
+  uint64_t crc64 = crc;
+  uint64_t word;
+
+  // bytes up to an 8 byte boundary
+  while (length > 0 && ((uintptr_t) data & 7) != 0) {
+    crc64 = _mm_crc32_u8((uint32_t) crc64, *data++);
+    length--;
+  }
+
+  while (length >= 8) {
+    memcpy(&word, data, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    data += 8;
+    length -= 8;
+  }
+
+  while (length--) {
+    crc64 = _mm_crc32_u8((uint32_t) crc64, *data++);
+  }
+
+  return (uint32_t) crc64;
+}
+#endif
+
+static inline uint32_t crc32c_update(uint32_t crc, const unsigned char *data,
+                                     size_t length) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    return crc32c_sse42_update(crc, data, length);
+  }
+#endif
+  return crc32c_table_update(crc, data, length);
+}
+
+static inline uint64_t rotate_left(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t read_64(const unsigned char *data) {
+  uint64_t value;
+
+  memcpy(&value, data, 8); // little endian hosts only
+  return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t lane, uint64_t input) {
+  lane += input * XXH_PRIME_2;
+  lane = rotate_left(lane, 31);
+  return lane * XXH_PRIME_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t hash, uint64_t lane) {
+  hash ^= xxh64_round(0, lane);
+  return hash * XXH_PRIME_1 + XXH_PRIME_4;
+}
+
+/**
+ * Feeds whole 32 byte stripes to the four xxh64 lanes
+ * @return: number of bytes consumed, a multiple of 32
+ */
+static inline size_t xxh64_stripes(checksum *sum, const unsigned char *data,
+                                   size_t length) {
+  const unsigned char *start = data;
+
+  while (length >= 32) {
+    sum->lanes[0] = xxh64_round(sum->lanes[0], read_64(data));
+    sum->lanes[1] = xxh64_round(sum->lanes[1], read_64(data + 8));
+    sum->lanes[2] = xxh64_round(sum->lanes[2], read_64(data + 16));
+    sum->lanes[3] = xxh64_round(sum->lanes[3], read_64(data + 24));
+    data += 32;
+    length -= 32;
+  }
+
+  return data - start;
+}
+
+/**
+ * Starts a new checksum of the given type
+ */
+static inline void checksum_init(checksum *sum, checksum_type type) {
+  memset(sum, 0, sizeof(checksum));
+  sum->type = type;
+  sum->crc = 0xFFFFFFFF;
+  sum->lanes[0] = XXH_PRIME_1 + XXH_PRIME_2; // seed 0
+  sum->lanes[1] = XXH_PRIME_2;
+  sum->lanes[2] = 0;
+  sum->lanes[3] = -XXH_PRIME_1;
+}
+
+/**
+ * Adds the next bytes of the file to the checksum
+ */
+static inline void checksum_update(checksum *sum, const void *buffer,
+                                   size_t length) {
+  const unsigned char *data = (const unsigned char*) buffer;
+  size_t used;
+
+  sum->offset += length;
+
+  if (sum->type == CHECKSUM_CRC32C) {
+    sum->crc = crc32c_update(sum->crc, data, length);
+    return;
+  }
+
+  // finish the stripe left over from the last call first
+  if (sum->stripe_length > 0) {
+    used = 32 - sum->stripe_length;
+    if (used > length) {
+      used = length;
+    }
+    memcpy(sum->stripe + sum->stripe_length, data, used);
+    sum->stripe_length += used;
+    data += used;
+    length -= used;
+
+    if (sum->stripe_length < 32) {
+      return;
+    }
+    xxh64_stripes(sum, sum->stripe, 32);
+    sum->stripe_length = 0;
+  }
+
+  used = xxh64_stripes(sum, data, length);
+  memcpy(sum->stripe, data + used, length - used);
+  sum->stripe_length = length - used;
+}
+
+/**
+ * Adds the bytes found at offset of the file. Anything between the last
+ * bytes fed and offset is a hole that was not read, and counts as zeros.
+ */
+static inline void checksum_feed_at(checksum *sum, off_t offset,
+                                    const void *buffer, size_t length) {
+  static const char zeros[ZERO_FEED_SIZE];
+  off_t gap;
+
+  while ((gap = offset - sum->offset) > 0) {
+    checksum_update(sum, zeros, gap > ZERO_FEED_SIZE ? ZERO_FEED_SIZE : gap);
+  }
+
+  checksum_update(sum, buffer, length);
+}
+
+/**
+ * Completes an xxh64 checksum
+ * @return: the 64-bit hash of everything fed so far
+ */
+static inline uint64_t xxh64_value(checksum *sum) {
+  const unsigned char *data = sum->stripe;
+  size_t length;
+  uint64_t hash;
+
+  if (sum->offset >= 32) {
+    hash = rotate_left(sum->lanes[0], 1) + rotate_left(sum->lanes[1], 7) +
+           rotate_left(sum->lanes[2], 12) + rotate_left(sum->lanes[3], 18);
+    hash = xxh64_merge(hash, sum->lanes[0]);
+    hash = xxh64_merge(hash, sum->lanes[1]);
+    hash = xxh64_merge(hash, sum->lanes[2]);
+    hash = xxh64_merge(hash, sum->lanes[3]);
+  } else {
+    hash = sum->lanes[2] + XXH_PRIME_5;
+  }
+
+  hash += (uint64_t) sum->offset;
+
+  // the last bytes that did not fill a stripe
+  for (length = sum->stripe_length; length >= 8; length -= 8, data += 8) {
+    hash ^= xxh64_round(0, read_64(data));
+    hash = rotate_left(hash, 27) * XXH_PRIME_1 + XXH_PRIME_4;
+  }
+
+  if (length >= 4) {
+    uint32_t word;
+
+    memcpy(&word, data, 4);
+    hash ^= (uint64_t) word * XXH_PRIME_1;
+    hash = rotate_left(hash, 23) * XXH_PRIME_2 + XXH_PRIME_3;
+    data += 4;
+    length -= 4;
+  }
+
+  while (length--) {
+    hash ^= (*data++) * XXH_PRIME_5;
+    hash = rotate_left(hash, 11) * XXH_PRIME_1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME_2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME_3;
+  hash ^= hash >> 32;
+
+  return hash;
+}
+
+/**
+ * The xxh64 of one block of memory
+ */
+static inline uint64_t xxh64_of(const void *data, size_t length) {
+  checksum sum;
+
+  checksum_init(&sum, CHECKSUM_XXH64);
+  checksum_update(&sum, data, length);
+
+  return xxh64_value(&sum);
+}
+
+/**
+ * The crc32c of one block of memory
+ */
+static inline uint32_t crc32c_of(const void *data, size_t length) {
+  return crc32c_update(0xFFFFFFFF, (const unsigned char*) data, length) ^
+         0xFFFFFFFF;
+}
+
+/**
+ * Completes the checksum of a file of the given size and writes it in
+ * hexadecimal to digest, which must have room for 17 characters
+ */
+static inline void checksum_final(checksum *sum, off_t file_size,
+                                  char *digest) {
+  checksum_feed_at(sum, file_size, "", 0); // a hole at the end
+
+  if (sum->type == CHECKSUM_CRC32C) {
+    sprintf(digest, "%08x", sum->crc ^ 0xFFFFFFFF);
+  } else {
+    sprintf(digest, "%016llx", (unsigned long long) xxh64_value(sum));
+  }
+}
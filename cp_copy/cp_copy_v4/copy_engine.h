@@ -0,0 +1,1403 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// copy engine used by cp_copy_v4
+//
+// Data is moved by the kernel whenever possible. The engine tries, in order:
+//   1. copy_file_range() - file to file, no user-space buffer at all and
+//                          the file system may offload or share the blocks.
+//   2. sendfile()        - page cache to file, no user-space buffer.
+//   3. splice()          - page cache -> pipe -> file, no user-space buffer.
+//   4. pread()/pwrite()  - the classic read/write loop of cp_copy_v2.
+// The memory-mapped copy of cp_copy_v3, an io_uring pipeline, which keeps
+// many reads and writes in flight at once, and a reader thread and a writer
+// thread sharing a ring of buffers are available as well, but are only used
+// when asked for; the last one needs -pthread.
+// A method that is not supported for the pair of files (different file
+// systems, old kernel, special files, ...) fails before moving any data, so
+// the engine just moves on to the next one.
+//
+// Every function copies the byte range [offset, offset + length) of the
+// source to the same offset of the target and does not rely on the file
+// position, so the same calls can be used for any part of a file.
+// The caller must define _GNU_SOURCE before including any header.
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "copy_stats.h"
+#include "uring.h"
+
+#define DEFAULT_BUFFER_SIZE (128 * 1024) // read/write buffer
+#define MAX_KERNEL_CHUNK (1 << 30) // bytes asked of the kernel per call
+#define SPLICE_CHUNK (64 * 1024) // default capacity of a pipe
+#define DEFAULT_WINDOW_SIZE (64 * 1024 * 1024) // mapped at a time by mmap
+#define DEFAULT_QUEUE_DEPTH 8 // reads and writes in flight with io_uring
+#define MAX_QUEUE_DEPTH 4096 // a ring twice as large is the kernel's limit
+#define DROP_CACHE_WINDOW (8 * 1024 * 1024) // copied between cache drops
+
+typedef enum _copy_method {
+  METHOD_AUTO, // try every method below, in order
+  METHOD_COPY_FILE_RANGE,
+  METHOD_SENDFILE,
+  METHOD_SPLICE,
+  METHOD_READ_WRITE,
+  METHOD_MMAP, // never chosen by METHOD_AUTO
+  METHOD_URING, // never chosen by METHOD_AUTO
+  METHOD_PIPELINE, // never chosen by METHOD_AUTO
+  NUM_METHODS
+} copy_method;
+
+static const char *method_names[NUM_METHODS] = {
+  "auto", "copy_file_range", "sendfile", "splice", "read/write", "mmap",
+  "io_uring", "pipeline"
+};
+
+// one registered buffer of the io_uring method and the read and
+// write that use it
+typedef struct _uring_slot {
+  off_t offset; // of the range in both files
+  size_t length;
+  int pending; // completions still to come, 0 when the slot is free
+  struct timespec queued; // for the statistics, when the pair was queued
+  int read_result; // result of the read, or -errno
+  int write_result; // result of the write, or -errno
+} uring_slot;
+
+// one buffer of the ring of the pipeline method
+typedef struct _pipeline_slot {
+  char *data;
+  off_t offset; // where the bytes read come from, and go to
+  ssize_t length; // bytes read
+} pipeline_slot;
+
+// what the two threads of the pipeline method share
+typedef struct _pipeline {
+  struct _copy_engine *engine;
+  int in_fd;
+  off_t offset; // range to copy
+  off_t length; // negative to copy until end of file
+  pipeline_slot *slots; // the ring, engine->queue_depth long
+  unsigned filled; // slots read and not written yet
+  int end_of_file; // the reader is done
+  int error; // errno of the first error, on either side
+  pthread_mutex_t lock; // protects filled, end_of_file and error
+  pthread_cond_t not_full; // a slot was written
+  pthread_cond_t not_empty; // a slot was read, or the reader stopped
+  long long reader_syscalls; // added to the engine once the reader is done
+  double reader_blocked;
+} pipeline;
+
+typedef struct _copy_engine {
+  copy_method method; // method requested by the user
+  copy_method next_method; // first method still worth trying
+  char *buffer; // only used by the read/write method
+  size_t buffer_size;
+  size_t window_size; // only used by mmap, bytes of each file mapped
+  int pipe_fds[2]; // only used by splice, created on first use
+  int no_sendfile; // the target's file position is shared with others
+  uring ring; // only used by io_uring, set up on first use
+  unsigned queue_depth; // copies in flight, each a linked read and write,
+                        // or buffers in the ring of the pipeline
+  char *ring_buffers; // queue_depth registered buffers of buffer_size
+  struct _uring_slot *slots; // what each registered buffer is used for
+  int ring_files[2]; // source and target registered as fixed files
+  int uring_unavailable; // set once io_uring turned out not to work
+  char *pipeline_buffers; // queue_depth buffers of buffer_size
+  double reader_blocked; // seconds the pipeline reader waited for buffers
+  double writer_blocked; // seconds the pipeline writer waited for data
+  checksum *sum; // if not NULL, every byte copied is fed to it
+  long long syscalls; // number of data moving system calls issued
+  off_t bytes_by_method[NUM_METHODS]; // where the bytes went through
+  off_t bytes_cloned; // bytes shared with the source instead of copied
+  int sparse; // a sparse_mode, see sparse.h
+  int skip_zeros; // leave blocks of zeros out of the target (as holes)
+  int punch_holes; // and punch them, for targets that held data before
+  off_t bytes_skipped; // zeros that were not written
+  size_t direct_align; // files opened with O_DIRECT: offsets, sizes and
+                       // buffer are multiples of this; 0 otherwise
+  int drop_cache; // drop each finished range from the page cache
+  copy_stats *stats; // if not NULL, every data moving call is timed
+} copy_engine;
+
+/**
+ * Converts the name of a method, as given on the command line,
+ * to a copy_method
+ * @return: the method or -1 if the name is unknown
+ */
+static inline int method_from_name(const char *name) {
+  int i;
+
+  for (i = 0; i < NUM_METHODS; i++) {
+    if (strcmp(name, method_names[i]) == 0) {
+      return i;
+    }
+  }
+
+  // allow the shorter spellings
+  if (strcmp(name, "rw") == 0) {
+    return METHOD_READ_WRITE;
+  } else if (strcmp(name, "uring") == 0) {
+    return METHOD_URING;
+  }
+
+  return -1;
+}
+
+/**
+ * Prepares an engine for the given method. The buffer is allocated
+ * here, not on first use, so that a failure is reported up front.
+ * @return: 0 on success
+ *          -1 if the buffer could not be allocated
+ */
+static inline int engine_init(copy_engine *engine, copy_method method,
+                              size_t buffer_size) {
+  memset(engine, 0, sizeof(copy_engine));
+  engine->method = method;
+  engine->next_method =
+      (method == METHOD_AUTO) ? METHOD_COPY_FILE_RANGE : method;
+  engine->buffer_size = buffer_size;
+  engine->window_size = DEFAULT_WINDOW_SIZE;
+  engine->pipe_fds[0] = engine->pipe_fds[1] = -1;
+  engine->ring.fd = -1;
+  engine->queue_depth = DEFAULT_QUEUE_DEPTH;
+  engine->ring_files[0] = engine->ring_files[1] = -1;
+
+  if ((engine->buffer = malloc(buffer_size)) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Closes the pipe of the splice method, keeping errno
+ */
+static inline void close_pipe(copy_engine *engine) {
+  int saved_errno = errno;
+
+  if (engine->pipe_fds[0] != -1) {
+    close(engine->pipe_fds[0]);
+    close(engine->pipe_fds[1]);
+    engine->pipe_fds[0] = engine->pipe_fds[1] = -1;
+  }
+  errno = saved_errno;
+}
+
+/**
+ * Releases the buffer and the pipe of an engine
+ */
+static inline void engine_free(copy_engine *engine) {
+  free(engine->buffer);
+  engine->buffer = NULL;
+
+  close_pipe(engine);
+
+  if (engine->ring.fd != -1) {
+    uring_exit(&engine->ring); // also unregisters buffers and files
+  }
+  free(engine->ring_buffers);
+  free(engine->slots);
+  free(engine->pipeline_buffers);
+  engine->ring_buffers = NULL;
+  engine->slots = NULL;
+  engine->pipeline_buffers = NULL;
+}
+
+/**
+ * An error that means "this method cannot copy between these two files",
+ * as opposed to a real I/O error.
+ */
+static inline int method_unsupported(int error) {
+  return error == ENOSYS || error == EXDEV || error == EINVAL ||
+         error == EOPNOTSUPP || error == EBADF || error == ENOTSUP;
+}
+
+/**
+ * Tells whether a block holds nothing but zeros. If the first byte is
+ * zero and every byte equals the one after it, they are all zero;
+ * memcmp() is much faster than a loop over the bytes.
+ */
+static inline int is_zero_block(const char *block, size_t size) {
+  return size == 0 ||
+         (block[0] == 0 && memcmp(block, block + 1, size - 1) == 0);
+}
+
+/**
+ * Turns a range of a file into a hole, without changing the file size
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int punch_hole(copy_engine *engine, int fd, off_t offset,
+                             off_t length) {
+  engine->syscalls++;
+  return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                   length);
+}
+
+/**
+ * A block of zeros that does not need to be written: the target already
+ * reads as zeros there, or a hole is punched to make it so
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int skip_zero_block(copy_engine *engine, int out_fd,
+                                  off_t offset, off_t length) {
+  engine->bytes_skipped += length;
+
+  if (engine->punch_holes) {
+    return punch_hole(engine, out_fd, offset, length);
+  }
+
+  return 0;
+}
+
+/**
+ * Copies with copy_file_range(). Both offsets are passed explicitly,
+ * so neither file position moves.
+ * @return: number of bytes copied, smaller than length only at end of file
+ *          -1 on error
+ */
+static inline off_t copy_with_copy_file_range(copy_engine *engine, int in_fd,
+                                              int out_fd, off_t offset,
+                                              off_t length) {
+  loff_t in_offset = offset;
+  loff_t out_offset = offset;
+  struct timespec start;
+  off_t done = 0;
+  ssize_t n;
+
+  while (done < length) {
+    size_t want = (length - done > MAX_KERNEL_CHUNK) ? MAX_KERNEL_CHUNK
+                                                     : length - done;
+
+    engine->syscalls++;
+    stats_start(engine->stats, &start);
+    n = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, want, 0);
+    stats_record(engine->stats, STAT_COPY, &start, n);
+
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return done > 0 ? done : -1;
+    } else if (n == 0) {
+      break; // end of source
+    }
+
+    done += n;
+  }
+
+  return done;
+}
+
+/**
+ * Copies with sendfile(). sendfile() only takes an offset for the input,
+ * so the target is positioned with lseek() first.
+ * @return: number of bytes copied, smaller than length only at end of file
+ *          -1 on error
+ */
+static inline off_t copy_with_sendfile(copy_engine *engine, int in_fd,
+                                       int out_fd, off_t offset,
+                                       off_t length) {
+  off_t in_offset = offset;
+  struct timespec start;
+  off_t done = 0;
+  ssize_t n;
+
+  if (lseek(out_fd, offset, SEEK_SET) == -1) {
+    return -1;
+  }
+
+  while (done < length) {
+    size_t want = (length - done > MAX_KERNEL_CHUNK) ? MAX_KERNEL_CHUNK
+                                                     : length - done;
+
+    engine->syscalls++;
+    stats_start(engine->stats, &start);
+    n = sendfile(out_fd, in_fd, &in_offset, want);
+    stats_record(engine->stats, STAT_COPY, &start, n);
+
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return done > 0 ? done : -1;
+    } else if (n == 0) {
+      break;
+    }
+
+    done += n;
+  }
+
+  return done;
+}
+
+/**
+ * Copies with splice(), going through a pipe owned by the engine:
+ * the source pages are moved into the pipe and then out of it into
+ * the target, without ever being copied to user space.
+ * @return: number of bytes copied, smaller than length only at end of file
+ *          -1 on error
+ */
+static inline off_t copy_with_splice(copy_engine *engine, int in_fd,
+                                     int out_fd, off_t offset, off_t length) {
+  loff_t in_offset = offset;
+  loff_t out_offset = offset;
+  struct timespec start;
+  off_t done = 0;
+  ssize_t in_pipe;
+  ssize_t n;
+
+  if (engine->pipe_fds[0] == -1 && pipe(engine->pipe_fds) == -1) {
+    return -1;
+  }
+
+  while (done < length) {
+    size_t want = (length - done > SPLICE_CHUNK) ? SPLICE_CHUNK
+                                                 : length - done;
+
+    engine->syscalls++;
+    stats_start(engine->stats, &start);
+    in_pipe = splice(in_fd, &in_offset, engine->pipe_fds[1], NULL, want,
+                     SPLICE_F_MOVE);
+    stats_record(engine->stats, STAT_READ, &start, in_pipe);
+
+    if (in_pipe == -1) {
+      if (errno == EINTR) continue;
+      return done > 0 ? done : -1;
+    } else if (in_pipe == 0) {
+      break;
+    }
+
+    // drain the pipe completely, so it is empty for the next round
+    // or for a fallback to another method
+    while (in_pipe > 0) {
+      engine->syscalls++;
+      stats_start(engine->stats, &start);
+      n = splice(engine->pipe_fds[0], NULL, out_fd, &out_offset, in_pipe,
+                 SPLICE_F_MOVE);
+      stats_record(engine->stats, STAT_WRITE, &start, n);
+
+      if (n == -1 && errno == EINTR) {
+        continue;
+      } else if (n <= 0) {
+        // the pipe still holds data: it cannot be used again, and the
+        // next copy with splice() makes a new one
+        if (n == 0) {
+          errno = EIO; // the target takes no more, retrying would spin
+        }
+        close_pipe(engine);
+        return -1;
+      }
+
+      in_pipe -= n;
+      done += n;
+    }
+  }
+
+  return done;
+}
+
+/**
+ * Copies through the engine's buffer with pread() and pwrite().
+ * This works for every pair of regular files and is the last resort.
+ * A negative length means copy until end of file, which is what is
+ * needed for sources whose size is not known (pipes, ttys, ...) and for
+ * targets that cannot be sized (FIFOs, devices, ...); in that case plain
+ * read() and write() are used because those cannot seek.
+ * @return: number of bytes copied, smaller than length only at end of file
+ *          -1 on error
+ */
+static inline off_t copy_with_read_write(copy_engine *engine, int in_fd,
+                                         int out_fd, off_t offset,
+                                         off_t length) {
+  struct timespec start;
+  off_t done = 0;
+  ssize_t n_chars;
+  ssize_t written;
+  ssize_t n;
+
+  while (length < 0 || done < length) {
+    size_t want = engine->buffer_size;
+    size_t to_write;
+    off_t end_of_file = -1; // known when O_DIRECT reads a partial block
+
+    if (length >= 0 && length - done < (off_t) want) {
+      want = length - done;
+
+      // O_DIRECT moves whole blocks; past the end of the file the read
+      // is short anyway
+      if (engine->direct_align > 0) {
+        want = (want + engine->direct_align - 1) / engine->direct_align *
+               engine->direct_align;
+      }
+    }
+
+    engine->syscalls++;
+    stats_start(engine->stats, &start);
+    if (length < 0) {
+      n_chars = read(in_fd, engine->buffer, want);
+    } else {
+      n_chars = pread(in_fd, engine->buffer, want, offset + done);
+    }
+    stats_record(engine->stats, STAT_READ, &start, n_chars);
+
+    if (n_chars == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    } else if (n_chars == 0) {
+      break;
+    }
+
+    // With O_DIRECT, a whole block read past the end of the range is
+    // written back whole: the bytes after the range are the source's own.
+    // A partial block is the end of the file, and is written as a whole
+    // block too, padded with zeros that are cut off again below.
+    to_write = n_chars;
+    if (engine->direct_align > 0 && n_chars % engine->direct_align != 0) {
+      to_write = n_chars + engine->direct_align -
+                 n_chars % engine->direct_align;
+      memset(engine->buffer + n_chars, 0, to_write - n_chars);
+      end_of_file = offset + done + n_chars;
+    }
+    if (length >= 0 && n_chars > length - done) {
+      n_chars = length - done;
+    }
+
+    // the data is in the buffer anyway, so checksumming it costs no I/O
+    if (engine->sum != NULL) {
+      checksum_feed_at(engine->sum, offset + done, engine->buffer, n_chars);
+    }
+
+    if (engine->skip_zeros && length >= 0 &&
+        is_zero_block(engine->buffer, n_chars)) {
+      if (skip_zero_block(engine, out_fd, offset + done, n_chars) == -1) {
+        return -1;
+      }
+      done += n_chars;
+      continue;
+    }
+
+    // a write may be short, e.g. when interrupted by a signal
+    for (written = 0; written < (ssize_t) to_write; written += n) {
+      engine->syscalls++;
+      stats_start(engine->stats, &start);
+      if (length < 0) {
+        n = write(out_fd, engine->buffer + written, to_write - written);
+      } else {
+          n = pwrite(out_fd, engine->buffer + written, to_write - written,
+                     offset + done + written);
+      }
+      stats_record(engine->stats, STAT_WRITE, &start, n);
+
+      if (n == -1) {
+        if (errno == EINTR) {
+          n = 0;
+          continue;
+        }
+        return -1;
+      }
+    }
+
+    done += n_chars;
+
+    if (end_of_file != -1) {
+      engine->syscalls++;
+      if (ftruncate(out_fd, end_of_file) == -1) {
+        return -1;
+      }
+      break;
+    }
+  }
+
+  return done;
+}
+
+/**
+ * Maps one window of a file
+ * @return: the address of the window or MAP_FAILED
+ */
+static inline char *map_window(copy_engine *engine, int fd, int prot,
+                               off_t offset, size_t length, int advice) {
+  char *address;
+
+  engine->syscalls++;
+  address = mmap(NULL, length, prot, MAP_SHARED, fd, offset);
+
+  if (address != MAP_FAILED) {
+    engine->syscalls++;
+    madvise(address, length, advice);
+  }
+
+  return address;
+}
+
+/**
+ * Copies by mapping both files and doing a memcpy(), as in cp_copy_v3, but
+ * through a window of engine->window_size bytes that slides over the range,
+ * so files larger than memory, or than the address space, can be copied
+ * and only one window of each file is ever mapped.
+ * The target must be opened read/write and already be at least
+ * offset + length bytes long. mmap() offsets must be multiples of the
+ * page size, so the first window starts at the page holding offset.
+ *
+ * The source window is read once, front to back, which MADV_SEQUENTIAL
+ * tells the kernel so it reads ahead aggressively; when the window is done
+ * MADV_DONTNEED drops it. Without pacing, every page dirtied through the
+ * target map would be written back in one burst at munmap() time or later.
+ * Instead, writeback of each finished window is started right away and the
+ * copy waits for the window before it, so at most two windows of dirty
+ * pages exist at a time. msync(MS_ASYNC) does nothing on Linux, so
+ * sync_file_range() is used to start and to wait for that writeback.
+ *
+ * When zeros are skipped, the source is looked at one page at a time and
+ * zero pages are never touched in the target, so they stay holes.
+ * @return: number of bytes copied
+ *          -1 on error
+ */
+static inline off_t copy_with_mmap(copy_engine *engine, int in_fd,
+                                   int out_fd, off_t offset, off_t length) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  off_t end = offset + length;
+  off_t window_offset = offset - offset % page_size;
+  off_t previous_offset = -1;
+  size_t previous_length = 0;
+  size_t window;
+  size_t window_length;
+  char *source_address;
+  char *destination_address;
+  struct timespec start;
+  off_t from;
+  off_t done;
+  off_t step;
+  int result = 0;
+
+  // the window must be a whole number of pages
+  window = engine->window_size;
+  window = (window + page_size - 1) / page_size * page_size;
+
+  while (window_offset < end && result == 0) {
+    window_length = (end - window_offset > (off_t) window)
+                        ? window : (size_t) (end - window_offset);
+    from = (offset > window_offset) ? offset - window_offset : 0;
+
+    if ((source_address = map_window(engine, in_fd, PROT_READ, window_offset,
+                                     window_length, MADV_SEQUENTIAL))
+        == MAP_FAILED) {
+      return -1;
+    }
+
+    if ((destination_address = map_window(engine, out_fd,
+                                          PROT_READ | PROT_WRITE,
+                                          window_offset, window_length,
+                                          MADV_SEQUENTIAL)) == MAP_FAILED) {
+      munmap(source_address, window_length);
+      return -1;
+    }
+
+    // the page faults of the memcpy() are where the I/O happens
+    stats_start(engine->stats, &start);
+    if (!engine->skip_zeros) {
+      memcpy(destination_address + from, source_address + from,
+             window_length - from);
+    } else {
+      for (done = from; done < (off_t) window_length; done += step) {
+        step = ((off_t) window_length - done > page_size)
+                   ? page_size : (off_t) window_length - done;
+
+        if (!is_zero_block(source_address + done, step)) {
+          memcpy(destination_address + done, source_address + done, step);
+        } else if (skip_zero_block(engine, out_fd, window_offset + done,
+                                   step) == -1) {
+          result = -1;
+          break;
+        }
+      }
+    }
+
+    stats_record(engine->stats, STAT_COPY, &start, window_length - from);
+
+    if (engine->sum != NULL) {
+      checksum_feed_at(engine->sum, window_offset + from,
+                       source_address + from, window_length - from);
+    }
+
+    // this window is finished: drop the source pages and unmap both,
+    // which hands the dirty target pages over to the page cache
+    engine->syscalls += 3;
+    madvise(source_address, window_length, MADV_DONTNEED);
+    munmap(source_address, window_length);
+    munmap(destination_address, window_length);
+
+    // start writing this window back, and wait for the previous one
+    engine->syscalls++;
+    sync_file_range(out_fd, window_offset + from, window_length - from,
+                    SYNC_FILE_RANGE_WRITE);
+    if (previous_offset != -1) {
+      engine->syscalls++;
+      sync_file_range(out_fd, previous_offset, previous_length,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                      SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+
+    previous_offset = window_offset + from;
+    previous_length = window_length - from;
+    window_offset += window_length;
+  }
+
+  return (result == -1) ? -1 : length;
+}
+
+/**
+ * Gives up on io_uring after a failed setup: closes the ring and frees
+ * its buffers, keeping errno
+ */
+static inline void uring_give_up(copy_engine *engine) {
+  int saved_errno = errno;
+
+  if (engine->ring.fd != -1) {
+    uring_exit(&engine->ring); // also unregisters buffers and files
+  }
+  free(engine->ring_buffers);
+  free(engine->slots);
+  engine->ring_buffers = NULL;
+  engine->slots = NULL;
+  engine->ring_files[0] = engine->ring_files[1] = -1;
+  engine->uring_unavailable = 1;
+  errno = saved_errno;
+}
+
+/**
+ * Sets up the io_uring of an engine on first use: the ring, the buffers,
+ * registered once so the kernel does not have to map them for every
+ * request, and the two files, registered so the requests refer to them
+ * by index and the kernel does not look up the file descriptors each time.
+ * Registering the buffers locks them in memory, which RLIMIT_MEMLOCK may
+ * not allow.
+ * @return: 0 on success
+ *          -1 on error; the ring is then closed and uring_unavailable set,
+ *          so the copy goes on with the read/write loop, unless the queue
+ *          depth is out of range (EINVAL)
+ */
+static inline int uring_prepare(copy_engine *engine, int in_fd, int out_fd) {
+  struct iovec *iovecs;
+  unsigned i;
+  int result;
+
+  // a bad depth is the caller's mistake, not a reason to fall back
+  if (engine->queue_depth == 0 || engine->queue_depth > MAX_QUEUE_DEPTH) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (engine->ring.fd == -1) {
+    engine->syscalls++;
+    if (uring_init(&engine->ring, 2 * engine->queue_depth) == -1) {
+      uring_give_up(engine);
+      return -1;
+    }
+
+    engine->slots = calloc(engine->queue_depth, sizeof(uring_slot));
+    iovecs = calloc(engine->queue_depth, sizeof(struct iovec));
+    if (engine->slots == NULL || iovecs == NULL ||
+        posix_memalign((void**) &engine->ring_buffers, sysconf(_SC_PAGESIZE),
+                       engine->queue_depth * engine->buffer_size) != 0) {
+      engine->ring_buffers = NULL;
+      free(iovecs);
+      errno = ENOMEM;
+      uring_give_up(engine);
+      return -1;
+    }
+
+    for (i = 0; i < engine->queue_depth; i++) {
+      iovecs[i].iov_base = engine->ring_buffers + i * engine->buffer_size;
+      iovecs[i].iov_len = engine->buffer_size;
+    }
+
+    engine->syscalls++;
+    result = uring_register_call(engine->ring.fd, IORING_REGISTER_BUFFERS,
+                                 iovecs, engine->queue_depth);
+    free(iovecs);
+    if (result == -1) {
+      uring_give_up(engine);
+      return -1;
+    }
+  }
+
+  if (engine->ring_files[0] != in_fd || engine->ring_files[1] != out_fd) {
+    if (engine->ring_files[0] != -1) {
+      engine->syscalls++;
+      uring_register_call(engine->ring.fd, IORING_UNREGISTER_FILES, NULL, 0);
+    }
+
+    engine->ring_files[0] = in_fd;
+    engine->ring_files[1] = out_fd;
+    engine->syscalls++;
+    if (uring_register_call(engine->ring.fd, IORING_REGISTER_FILES,
+                            engine->ring_files, 2) == -1) {
+      uring_give_up(engine);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Queues the copy of one buffer: a read into the slot's registered buffer
+ * linked to the write of that buffer, so the kernel starts the write as
+ * soon as the read is done, without waiting for us.
+ * @return: 0 on success
+ *          -1 if the submission queue has no room for both
+ */
+static inline int uring_queue_slot(copy_engine *engine, unsigned index) {
+  uring_slot *slot = &engine->slots[index];
+  char *buffer = engine->ring_buffers + index * engine->buffer_size;
+  struct io_uring_sqe *sqe;
+  struct io_uring_sqe *write_sqe;
+
+  // the read and its write are queued together or not at all
+  if (uring_sq_space(&engine->ring) < 2 ||
+      (sqe = uring_get_sqe(&engine->ring)) == NULL ||
+      (write_sqe = uring_get_sqe(&engine->ring)) == NULL) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  sqe->opcode = IORING_OP_READ_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+  sqe->fd = 0; // index of the source among the registered files
+  sqe->addr = (unsigned long) buffer;
+  sqe->len = slot->length;
+  sqe->off = slot->offset;
+  sqe->buf_index = index;
+  sqe->user_data = index * 2;
+
+  sqe = write_sqe;
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = 1; // index of the target
+  sqe->addr = (unsigned long) buffer;
+  sqe->len = slot->length;
+  sqe->off = slot->offset;
+  sqe->buf_index = index;
+  sqe->user_data = index * 2 + 1;
+
+  slot->pending = 2;
+  stats_start(engine->stats, &slot->queued);
+  return 0;
+}
+
+/**
+ * Takes back the entries the kernel did not take from the submission
+ * queue, after a failed submission; only io_uring_enter() takes them, so
+ * they are ours again until the next one
+ * @return: number of slots no longer in flight
+ */
+static inline unsigned uring_withdraw(copy_engine *engine) {
+  uring *ring = &engine->ring;
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail;
+  unsigned freed = 0;
+  unsigned index;
+
+  for (; tail != head; tail--) {
+    index = ring->sq_array[(tail - 1) & *ring->sq_mask];
+    if (--engine->slots[ring->sqes[index].user_data / 2].pending == 0) {
+      freed++;
+    }
+  }
+  __atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+
+  return freed;
+}
+
+/**
+ * Copies with io_uring: up to queue_depth linked read/write pairs are kept
+ * in flight, one per registered buffer, so the devices see a queue of
+ * requests instead of one synchronous call at a time.
+ * A read that comes back short breaks the link and the kernel cancels its
+ * write; that rare case, and short writes, are finished with pread() and
+ * pwrite() once both completions of the buffer are in.
+ * For the statistics, each read and each write takes from the time its
+ * pair was queued to the time its completion is seen.
+ * A submission the kernel refuses for want of resources (EAGAIN, EBUSY)
+ * is tried again once completions are seen. On any other failure, the
+ * requests the kernel took are still reading into and writing from the
+ * buffers: they are waited for before returning, and if even that fails
+ * the ring is closed and its buffers are left to the kernel.
+ * @return: number of bytes copied, smaller than length only at end of file
+ *          -1 on error
+ */
+static inline off_t copy_with_uring(copy_engine *engine, int in_fd,
+                                    int out_fd, off_t offset, off_t length) {
+  off_t next = offset;
+  off_t end = offset + length;
+  off_t missing = 0; // bytes the source no longer has
+  off_t n;
+  unsigned in_flight = 0;
+  unsigned i;
+  struct io_uring_cqe *cqe;
+  uring_slot *slot;
+  struct timespec pause = { 0, 1000000 }; // while the kernel is short
+  int draining = 0;
+  int error = 0;
+  int good;
+
+  if (uring_prepare(engine, in_fd, out_fd) == -1) {
+    return -1;
+  }
+
+  while ((next < end && error == 0) || in_flight > 0) {
+    // give every free buffer a range to copy
+    for (i = 0; i < engine->queue_depth && next < end && error == 0; i++) {
+      slot = &engine->slots[i];
+      if (slot->pending > 0) {
+        continue;
+      }
+
+      slot->offset = next;
+      slot->length = (end - next > (off_t) engine->buffer_size)
+                         ? engine->buffer_size : (size_t) (end - next);
+      if (uring_queue_slot(engine, i) == -1) {
+        if (in_flight == 0) {
+          error = errno;
+        }
+        break; // queued again once completions free up room
+      }
+      next += slot->length;
+      in_flight++;
+    }
+
+    if (in_flight == 0) {
+      break; // nothing could be queued
+    }
+
+    engine->syscalls++;
+    if (uring_submit_and_wait(&engine->ring, 1) == -1) {
+      if (errno == EAGAIN || errno == EBUSY) {
+        // resources come back as completions are seen
+        if (uring_peek_cqe(&engine->ring) == NULL) {
+          nanosleep(&pause, NULL);
+        }
+      } else if (!draining) {
+          // what the kernel took may still be running: wait for it
+          draining = 1;
+          if (error == 0) {
+            error = errno;
+          }
+          in_flight -= uring_withdraw(engine);
+      } else {
+          // cannot even wait: closing the ring cancels the requests, but
+          // the buffers must not be used again until the kernel is done
+          if (error == 0) {
+            error = errno;
+          }
+          engine->ring_buffers = NULL;
+          uring_give_up(engine);
+          errno = error;
+          return -1;
+      }
+    }
+
+    while ((cqe = uring_peek_cqe(&engine->ring)) != NULL) {
+      slot = &engine->slots[cqe->user_data / 2];
+      if (cqe->user_data % 2 == 0) {
+        slot->read_result = cqe->res;
+        stats_record(engine->stats, STAT_READ, &slot->queued, cqe->res);
+      } else {
+        slot->write_result = cqe->res;
+        // counts the bytes written as copied
+        stats_record(engine->stats, STAT_WRITE, &slot->queued, cqe->res);
+      }
+      uring_cqe_seen(&engine->ring);
+
+      if (--slot->pending > 0) {
+        continue;
+      }
+      in_flight--;
+
+      if (slot->read_result < 0 && slot->read_result != -EAGAIN) {
+        error = -slot->read_result;
+        continue;
+      } else if (slot->write_result < 0 &&
+                 slot->write_result != -ECANCELED &&
+                 slot->write_result != -EAGAIN) {
+        error = -slot->write_result;
+        continue;
+      }
+
+      // bytes that were both read and written
+      good = slot->write_result < slot->read_result ? slot->write_result
+                                                    : slot->read_result;
+      if (good < 0) {
+        good = 0;
+      }
+
+      if (good < (int) slot->length && error == 0) {
+        n = copy_with_read_write(engine, in_fd, out_fd, slot->offset + good,
+                                 slot->length - good);
+        if (n == -1) {
+          error = errno;
+        } else {
+          missing += slot->length - good - n;
+        }
+      }
+    }
+  }
+
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+
+  return length - missing;
+}
+
+/**
+ * Seconds since start, to add to a time spent blocked
+ */
+static inline double seconds_since(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * The reader thread of the pipeline method: fills the buffers of the ring
+ * in turn, waiting while they are all full
+ */
+static void *pipeline_reader(void *arg) {
+  pipeline *state = (pipeline*) arg;
+  copy_engine *engine = state->engine;
+  struct timespec start;
+  pipeline_slot *slot;
+  struct timespec call_start;
+  off_t next = state->offset;
+  unsigned index = 0;
+  size_t want;
+  ssize_t n_chars;
+
+  while (1) {
+    pthread_mutex_lock(&state->lock);
+    if (state->filled == engine->queue_depth && state->error == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while (state->filled == engine->queue_depth && state->error == 0) {
+        pthread_cond_wait(&state->not_full, &state->lock);
+      }
+      state->reader_blocked += seconds_since(&start);
+    }
+    if (state->error != 0) {
+      pthread_mutex_unlock(&state->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    // the slot is ours until it is counted as filled
+    slot = &state->slots[index];
+    want = engine->buffer_size;
+    if (state->length >= 0 &&
+        state->offset + state->length - next < (off_t) want) {
+      want = state->offset + state->length - next;
+    }
+
+    do {
+      state->reader_syscalls++;
+      stats_start(engine->stats, &call_start);
+      if (want == 0) {
+        n_chars = 0;
+      } else if (state->length < 0) {
+        n_chars = read(state->in_fd, slot->data, want);
+      } else {
+        n_chars = pread(state->in_fd, slot->data, want, next);
+      }
+      stats_record(engine->stats, STAT_READ, &call_start, n_chars);
+    } while (n_chars == -1 && errno == EINTR);
+
+    pthread_mutex_lock(&state->lock);
+    if (n_chars == -1) {
+      if (state->error == 0) {
+        state->error = errno;
+      }
+    } else if (n_chars == 0) {
+      state->end_of_file = 1;
+    } else {
+      slot->offset = next;
+      slot->length = n_chars;
+      state->filled++;
+      next += n_chars;
+      index = (index + 1) % engine->queue_depth;
+    }
+    pthread_cond_signal(&state->not_empty);
+    pthread_mutex_unlock(&state->lock);
+
+    if (n_chars <= 0) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Copies with two threads, so that reading and writing overlap: a reader
+ * thread fills a ring of engine->queue_depth buffers while the calling
+ * thread writes out the ones already full. In cp_copy_v1 the disk being
+ * read is idle during each write and the other way round; here the copy
+ * goes as fast as the slower of the two.
+ * The time each side spends waiting for the other is added to the engine,
+ * so the device that holds up the copy can be told: a reader that waits
+ * for free buffers means the target is the bottleneck, a writer that waits
+ * for data means the source is.
+ * Like the read/write loop, a negative length means copy until end of file,
+ * with read() and write().
+ * @return: number of bytes copied, smaller than length only at end of file
+ *          -1 on error
+ */
+static inline off_t copy_with_pipeline(copy_engine *engine, int in_fd,
+                                       int out_fd, off_t offset,
+                                       off_t length) {
+  pipeline state;
+  pthread_t reader;
+  struct timespec start;
+  pipeline_slot *slot;
+  struct timespec call_start;
+  unsigned index = 0;
+  off_t done = 0;
+  ssize_t written;
+  ssize_t n;
+  unsigned i;
+
+  // with no buffer, the reader would wait for a free one forever
+  if (engine->queue_depth == 0 || engine->queue_depth > MAX_QUEUE_DEPTH) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (engine->pipeline_buffers == NULL) {
+    engine->pipeline_buffers = malloc(engine->queue_depth *
+                                      engine->buffer_size);
+    if (engine->pipeline_buffers == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+
+  memset(&state, 0, sizeof(state));
+  state.engine = engine;
+  state.in_fd = in_fd;
+  state.offset = offset;
+  state.length = length;
+  if ((state.slots = calloc(engine->queue_depth,
+                           sizeof(pipeline_slot))) == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  for (i = 0; i < engine->queue_depth; i++) {
+    state.slots[i].data = engine->pipeline_buffers + i * engine->buffer_size;
+  }
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.not_full, NULL);
+  pthread_cond_init(&state.not_empty, NULL);
+
+  if ((errno = pthread_create(&reader, NULL, pipeline_reader, &state)) != 0) {
+    free(state.slots);
+    return -1;
+  }
+
+  while (1) {
+    pthread_mutex_lock(&state.lock);
+    if (state.filled == 0 && !state.end_of_file && state.error == 0) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      while (state.filled == 0 && !state.end_of_file && state.error == 0) {
+        pthread_cond_wait(&state.not_empty, &state.lock);
+      }
+      engine->writer_blocked += seconds_since(&start);
+    }
+    if (state.error != 0 || state.filled == 0) {
+      pthread_mutex_unlock(&state.lock);
+      break; // error, or every buffer written and end of file
+    }
+    pthread_mutex_unlock(&state.lock);
+
+    slot = &state.slots[index];
+
+    if (engine->sum != NULL) {
+      checksum_feed_at(engine->sum, slot->offset, slot->data, slot->length);
+    }
+
+    n = 0;
+    if (engine->skip_zeros && length >= 0 &&
+        is_zero_block(slot->data, slot->length)) {
+      if (skip_zero_block(engine, out_fd, slot->offset, slot->length) == -1) {
+        n = -1;
+      }
+    } else {
+      for (written = 0; written < slot->length; written += n) {
+        engine->syscalls++;
+        stats_start(engine->stats, &call_start);
+        if (length < 0) {
+          n = write(out_fd, slot->data + written, slot->length - written);
+        } else {
+            n = pwrite(out_fd, slot->data + written, slot->length - written,
+                       slot->offset + written);
+        }
+        stats_record(engine->stats, STAT_WRITE, &call_start, n);
+        if (n == -1) {
+          if (errno == EINTR) {
+            n = 0;
+            continue;
+          }
+          break;
+        }
+      }
+    }
+
+    // hand the buffer back to the reader
+    pthread_mutex_lock(&state.lock);
+    if (n == -1 && state.error == 0) {
+      state.error = errno;
+    } else if (n != -1) {
+      done += slot->length;
+    }
+    state.filled--;
+    pthread_cond_signal(&state.not_full);
+    pthread_mutex_unlock(&state.lock);
+    index = (index + 1) % engine->queue_depth;
+  }
+
+  pthread_join(reader, NULL);
+  engine->syscalls += state.reader_syscalls;
+  engine->reader_blocked += state.reader_blocked;
+
+  pthread_mutex_destroy(&state.lock);
+  pthread_cond_destroy(&state.not_full);
+  pthread_cond_destroy(&state.not_empty);
+  free(state.slots);
+
+  if (state.error != 0) {
+    errno = state.error;
+    return -1;
+  }
+
+  return done;
+}
+
+/**
+ * Removes a range that was copied from the page cache, in both files.
+ * Dirty pages cannot be dropped, so the range of the target is written
+ * back first.
+ */
+static inline void drop_cached_range(copy_engine *engine, int in_fd,
+                                     int out_fd, off_t offset,
+                                     off_t length) {
+  engine->syscalls += 3;
+  sync_file_range(out_fd, offset, length,
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                  SYNC_FILE_RANGE_WAIT_AFTER);
+  posix_fadvise(in_fd, offset, length, POSIX_FADV_DONTNEED);
+  posix_fadvise(out_fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * Copies [offset, offset + length) of in_fd to the same range of out_fd
+ * with the engine's method. With METHOD_AUTO, each method is tried in turn
+ * and a method that turns out to be unsupported is not tried again
+ * for the rest of the copy.
+ * @return: number of bytes copied, smaller than length only at end of file
+ *          -1 on error
+ */
+static inline off_t engine_copy_range(copy_engine *engine, int in_fd,
+                                      int out_fd, off_t offset,
+                                      off_t length) {
+  off_t done = 0;
+  off_t previous_offset = -1;
+  off_t previous_length = 0;
+  off_t step;
+  off_t n;
+
+  if (length < 0) {
+    // size unknown, only a plain read loop can do this, or two of them
+    if (engine->method == METHOD_PIPELINE && engine->direct_align == 0) {
+      n = copy_with_pipeline(engine, in_fd, out_fd, offset, length);
+      if (n > 0) engine->bytes_by_method[METHOD_PIPELINE] += n;
+    } else {
+      n = copy_with_read_write(engine, in_fd, out_fd, offset, length);
+      if (n > 0) engine->bytes_by_method[METHOD_READ_WRITE] += n;
+    }
+    if (n > 0 && engine->drop_cache) {
+      drop_cached_range(engine, in_fd, out_fd, offset, n);
+    }
+    return n;
+  }
+
+  while (done < length) {
+    copy_method method = engine->next_method;
+
+    // to drop the cache as the copy goes, copy one window at a time
+    step = length - done;
+    if (engine->drop_cache && step > DROP_CACHE_WINDOW) {
+      step = DROP_CACHE_WINDOW;
+    }
+
+    // sendfile() moves the file position of the target, which
+    // threads sharing the target cannot allow
+    if (method == METHOD_SENDFILE && engine->no_sendfile) {
+      method = engine->next_method = METHOD_SPLICE;
+    }
+
+    // only methods that see the data, in order, can find the blocks of
+    // zeros or checksum it
+    if ((engine->skip_zeros || engine->sum != NULL) &&
+        (method < METHOD_READ_WRITE || method == METHOD_URING)) {
+      method = METHOD_READ_WRITE;
+    }
+
+    // O_DIRECT needs the aligned buffer of the read/write loop;
+    // the other methods would go through the page cache anyway
+    if (engine->direct_align > 0) {
+      method = METHOD_READ_WRITE;
+    }
+
+    switch (method) {
+      case METHOD_COPY_FILE_RANGE:
+        n = copy_with_copy_file_range(engine, in_fd, out_fd, offset + done,
+                                      step);
+        break;
+      case METHOD_SENDFILE:
+        n = copy_with_sendfile(engine, in_fd, out_fd, offset + done, step);
+        break;
+      case METHOD_SPLICE:
+        n = copy_with_splice(engine, in_fd, out_fd, offset + done, step);
+        break;
+      case METHOD_MMAP:
+        n = copy_with_mmap(engine, in_fd, out_fd, offset + done, step);
+        break;
+      case METHOD_URING:
+        n = copy_with_uring(engine, in_fd, out_fd, offset + done, step);
+        break;
+      case METHOD_PIPELINE:
+        n = copy_with_pipeline(engine, in_fd, out_fd, offset + done, step);
+        break;
+      default:
+        n = copy_with_read_write(engine, in_fd, out_fd, offset + done, step);
+        break;
+    }
+
+    if (n > 0) {
+      // a short count means end of file or an error part way through;
+      // the next call of the same method tells which one it was
+      engine->bytes_by_method[method] += n;
+
+      // start writing this window back, and drop the one before it,
+      // whose writeback should be done by now
+      if (engine->drop_cache) {
+        engine->syscalls++;
+        sync_file_range(out_fd, offset + done, n, SYNC_FILE_RANGE_WRITE);
+        if (previous_offset != -1) {
+          drop_cached_range(engine, in_fd, out_fd, previous_offset,
+                            previous_length);
+        }
+        previous_offset = offset + done;
+        previous_length = n;
+      }
+
+      done += n;
+    } else if (n == 0) {
+      break; // end of file
+    } else if (method == METHOD_URING && engine->uring_unavailable) {
+      // no io_uring on this kernel, or it is disabled:
+      // use the read/write loop it replaces
+      engine->next_method = METHOD_READ_WRITE;
+    } else if (engine->method == METHOD_AUTO && method != METHOD_READ_WRITE &&
+               method_unsupported(errno)) {
+      engine->next_method++; // fall back to the next method
+    } else {
+      return -1;
+    }
+  }
+
+  if (previous_offset != -1) {
+    drop_cached_range(engine, in_fd, out_fd, previous_offset,
+                      previous_length);
+  }
+
+  return done;
+}
+
+/**
+ * Prints on stderr how many bytes went through each method, so it is
+ * easy to check that the zero-copy path is taken on a file system
+ */
+static inline void engine_report(copy_engine *engine, const char *name) {
+  int i;
+
+  if (engine->bytes_cloned > 0) {
+    fprintf(stderr, "%s: %lld bytes cloned\n", name,
+            (long long) engine->bytes_cloned);
+  }
+
+  if (engine->bytes_skipped > 0) {
+    fprintf(stderr, "%s: %lld bytes left as holes\n", name,
+            (long long) engine->bytes_skipped);
+  }
+
+  for (i = METHOD_COPY_FILE_RANGE; i < NUM_METHODS; i++) {
+    if (engine->bytes_by_method[i] > 0) {
+      fprintf(stderr, "%s: %lld bytes copied with %s\n", name,
+              (long long) engine->bytes_by_method[i], method_names[i]);
+    }
+  }
+
+  if (engine->bytes_by_method[METHOD_PIPELINE] > 0) {
+    fprintf(stderr, "%s: reader waited %.3f s for free buffers (target "
+            "slower), writer waited %.3f s for data (source slower)\n", name,
+            engine->reader_blocked, engine->writer_blocked);
+  }
+
+  fprintf(stderr, "%s: %lld system calls\n", name, engine->syscalls);
+}
+
+/**
+ * Reads a whole file once, through the engine's buffer, and feeds it to
+ * a checksum. Used to verify a copy; the pages are dropped from the cache
+ * first so they really come from the device.
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int engine_checksum_file(copy_engine *engine, int fd,
+                                       checksum *sum) {
+  off_t offset = 0;
+  ssize_t n_chars;
+
+  engine->syscalls += 2;
+  if (fdatasync(fd) == -1) {
+    return -1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  while (1) {
+    engine->syscalls++;
+    n_chars = pread(fd, engine->buffer, engine->buffer_size, offset);
+
+    if (n_chars == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    } else if (n_chars == 0) {
+      return 0;
+    }
+
+    checksum_update(sum, engine->buffer, n_chars);
+    offset += n_chars;
+
+    // with O_DIRECT, a partial block is the end of the file and the next
+    // offset is not aligned
+    if (engine->direct_align > 0 && n_chars % engine->direct_align != 0) {
+      return 0;
+    }
+  }
+}
@@ -0,0 +1,246 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// throughput statistics of a copy, used by copy_engine.h and cp_copy_v4
+//
+// Every read, write and in-kernel copy the engine makes can be timed:
+// how many calls of each kind, how long they took in total, and how their
+// latencies are spread, in a histogram of powers of two of microseconds.
+// The copying threads add to the counters with atomic operations, so one
+// set of statistics covers all of them. When statistics are off the
+// engine's pointer to them is NULL and each call only costs a test of it.
+// A reporter thread prints a progress line on stderr every few seconds,
+// and whenever the process gets SIGUSR1; it waits for both at once with
+// sigtimedwait(), so SIGUSR1 must be blocked in every thread, which is done
+// by blocking it before any thread is created.
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define STAT_BUCKETS 32 // latency buckets: < 1us, < 2us, < 4us, ...
+
+typedef enum _stat_kind {
+  STAT_READ, // read(), pread(), splice() into the pipe
+  STAT_WRITE, // write(), pwrite(), splice() out of the pipe
+  STAT_COPY, // copy_file_range(), sendfile(), memcpy() of a mapping
+  NUM_STAT_KINDS
+} stat_kind;
+
+static const char *stat_kind_names[NUM_STAT_KINDS] = {
+  "read", "write", "copy"
+};
+
+typedef struct _copy_stats {
+  struct timespec start; // when the copy started
+  long long bytes; // copied so far
+  long long calls[NUM_STAT_KINDS];
+  long long nanoseconds[NUM_STAT_KINDS]; // spent in the calls
+  long long histogram[NUM_STAT_KINDS][STAT_BUCKETS];
+
+  // the reporter thread
+  pthread_t reporter;
+  int reporter_running;
+  int stopping; // set to make the reporter return
+  double interval; // seconds between lines, 0 for SIGUSR1 only
+  long long last_bytes; // at the previous line, for the current speed
+  struct timespec last_time;
+} copy_stats;
+
+static inline long long nanoseconds_between(struct timespec *from,
+                                            struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000LL +
+         (to->tv_nsec - from->tv_nsec);
+}
+
+static inline void stats_init(copy_stats *stats) {
+  memset(stats, 0, sizeof(copy_stats));
+  clock_gettime(CLOCK_MONOTONIC, &stats->start);
+  stats->last_time = stats->start;
+}
+
+/**
+ * Notes the time before a call; does nothing when stats is NULL
+ */
+static inline void stats_start(copy_stats *stats, struct timespec *start) {
+  if (stats != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, start);
+  }
+}
+
+/**
+ * Adds bytes to the bytes copied
+ */
+static inline void stats_add_bytes(copy_stats *stats, long long bytes) {
+  if (stats != NULL && bytes > 0) {
+    __atomic_fetch_add(&stats->bytes, bytes, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Records a call that started at start and moved result bytes; the bytes
+ * count as copied once written. Does nothing when stats is NULL.
+ */
+static inline void stats_record(copy_stats *stats, stat_kind kind,
+                                struct timespec *start, long long result) {
+  struct timespec now;
+  long long elapsed;
+  long long micros;
+  int bucket = 0;
+
+  if (stats == NULL) {
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = nanoseconds_between(start, &now);
+  for (micros = elapsed / 1000; micros > 0 && bucket < STAT_BUCKETS - 1;
+       micros >>= 1) {
+    bucket++;
+  }
+
+  __atomic_fetch_add(&stats->calls[kind], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->nanoseconds[kind], elapsed, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->histogram[kind][bucket], 1, __ATOMIC_RELAXED);
+
+  if (kind != STAT_READ) {
+    stats_add_bytes(stats, result);
+  }
+}
+
+/**
+ * Prints one progress line on stderr: bytes copied, current and average
+ * speed, calls and time spent reading and writing
+ */
+static inline void stats_print(copy_stats *stats) {
+  struct timespec now;
+  long long bytes = __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED);
+  long long calls = 0;
+  double since_start;
+  double since_last;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  since_start = nanoseconds_between(&stats->start, &now) / 1e9;
+  since_last = nanoseconds_between(&stats->last_time, &now) / 1e9;
+
+  for (i = 0; i < NUM_STAT_KINDS; i++) {
+    calls += __atomic_load_n(&stats->calls[i], __ATOMIC_RELAXED);
+  }
+
+  fprintf(stderr, "stats: %.1f MB copied, %.1f MB/s now, %.1f MB/s average, "
+          "%lld calls, read %.3f s, write %.3f s, copy %.3f s\n", bytes / 1e6,
+          since_last > 0 ? (bytes - stats->last_bytes) / since_last / 1e6 : 0,
+          since_start > 0 ? bytes / since_start / 1e6 : 0, calls,
+          stats->nanoseconds[STAT_READ] / 1e9,
+          stats->nanoseconds[STAT_WRITE] / 1e9,
+          stats->nanoseconds[STAT_COPY] / 1e9);
+
+  stats->last_bytes = bytes;
+  stats->last_time = now;
+}
+
+/**
+ * Writes all the statistics as one JSON object
+ */
+static inline void stats_print_json(copy_stats *stats, FILE *output) {
+  struct timespec now;
+  double seconds;
+  int i;
+  int bucket;
+  int first;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  seconds = nanoseconds_between(&stats->start, &now) / 1e9;
+
+  fprintf(output, "{\"bytes\": %lld, \"seconds\": %.6f, "
+          "\"average_mb_per_s\": %.3f", stats->bytes, seconds,
+          seconds > 0 ? stats->bytes / seconds / 1e6 : 0);
+
+  for (i = 0; i < NUM_STAT_KINDS; i++) {
+    fprintf(output, ", \"%s\": {\"calls\": %lld, \"seconds\": %.6f, "
+            "\"latency_us\": {", stat_kind_names[i], stats->calls[i],
+            stats->nanoseconds[i] / 1e9);
+
+    // each bucket is named after its upper bound, empty ones are left out
+    for (bucket = 0, first = 1; bucket < STAT_BUCKETS; bucket++) {
+      if (stats->histogram[i][bucket] > 0) {
+        fprintf(output, "%s\"<%lld\": %lld", first ? "" : ", ",
+                1LL << bucket, stats->histogram[i][bucket]);
+        first = 0;
+      }
+    }
+    fprintf(output, "}}");
+  }
+
+  fprintf(output, "}\n");
+}
+
+/**
+ * The reporter thread: prints a line at every interval and on SIGUSR1
+ */
+static void *stats_reporter(void *arg) {
+  copy_stats *stats = (copy_stats*) arg;
+  struct timespec timeout;
+  sigset_t signals;
+  int received;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  timeout.tv_sec = (time_t) stats->interval;
+  timeout.tv_nsec = (long) ((stats->interval - timeout.tv_sec) * 1e9);
+
+  while (!__atomic_load_n(&stats->stopping, __ATOMIC_ACQUIRE)) {
+    if (stats->interval > 0) {
+      received = sigtimedwait(&signals, NULL, &timeout);
+    } else {
+      received = sigwaitinfo(&signals, NULL);
+    }
+
+    if (__atomic_load_n(&stats->stopping, __ATOMIC_ACQUIRE)) {
+      break;
+    } else if (received == SIGUSR1 || (received == -1 && errno == EAGAIN)) {
+      stats_print(stats);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Starts the reporter thread. Must be called before any other thread is
+ * created, as it blocks SIGUSR1 for the threads created after it.
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int stats_start_reporter(copy_stats *stats, double interval) {
+  sigset_t signals;
+
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  if ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)) != 0) {
+    return -1;
+  }
+
+  stats->interval = interval;
+  if ((errno = pthread_create(&stats->reporter, NULL, stats_reporter,
+                              stats)) != 0) {
+    return -1;
+  }
+  stats->reporter_running = 1;
+
+  return 0;
+}
+
+/**
+ * Stops the reporter thread, waking it up with SIGUSR1
+ */
+static inline void stats_stop_reporter(copy_stats *stats) {
+  if (stats->reporter_running) {
+    __atomic_store_n(&stats->stopping, 1, __ATOMIC_RELEASE);
+    pthread_kill(stats->reporter, SIGUSR1);
+    pthread_join(stats->reporter, NULL);
+    stats->reporter_running = 0;
+  }
+}
@@ -0,0 +1,418 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// benchmark of the copy methods of cp_copy_v4
+//
+// cp_copy_v2 was written to see how the buffer size changes the time a copy
+// takes. This program does that experiment for every method of the copy
+// engine: each source is copied with each method and, for the methods that
+// have a buffer, with every power of two buffer size between the smallest
+// and the largest asked for. Each run is written as one CSV line with
+// throughput, system calls and CPU time, so the best way to copy can be
+// picked for each file size on each machine. The method of a line is the
+// one the bytes actually went through: io_uring falls back to read/write
+// where it is not available. A method that cannot copy the file at all is
+// skipped, with a note on stderr, and the others still run.
+// The read/write buffer is the buffer size, the mmap window and the io_uring
+// and pipeline buffers are too; the kernel methods have no buffer and are
+// run once. The pipeline method uses a thread, so link with -pthread.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+
+#define MIN_BUFFER_SIZE 1
+#define MAX_BUFFER_SIZE (16 * 1024 * 1024)
+#define TEMP_TARGET "cp_copy_bench.tmp"
+#define MAX_RUNS 1000000 // -n, runs of each combination
+
+typedef enum _bench_cache {
+  BENCH_DROP, // start every run with the files out of the page cache
+  BENCH_WARM, // start every run with the source in the page cache
+  BENCH_KEEP // leave the cache alone
+} bench_cache;
+
+static const char *cache_names[] = { "drop", "warm", "keep" };
+
+typedef struct _bench_options {
+  int methods[NUM_METHODS]; // -m, the methods to run
+  size_t min_buffer; // smallest buffer size
+  size_t max_buffer; // largest buffer size
+  int runs; // -n, runs of each combination
+  bench_cache cache; // --cache
+  int sync; // -s, include fdatasync() of the target in the time
+  char *target; // -o, file the copies are written to
+} bench_options;
+
+void die(char *string_1, char *string_2); // print error and quit
+void usage(char *program_name);
+size_t parse_size(char *string);
+int parse_count(char *string, char *what, int max);
+void parse_methods(char *list, bench_options *options);
+void prepare_cache(char *source, int source_fd, bench_options *options);
+double seconds_of(struct timeval *time);
+void bench_file(char *source, bench_options *options, FILE *output);
+void used_methods(copy_engine *engine, copy_method method, char *label,
+                  size_t size);
+int run_once(char *source, int source_fd, off_t length, copy_method method,
+             size_t buffer_size, int run, bench_options *options,
+             FILE *output);
+
+int main(int argc, char *argv[]) {
+  bench_options options;
+  FILE *output = stdout;
+  int ch;
+  int i;
+  char short_options[] = "b:B:c:f:m:n:o:s";
+  struct option long_options[] = {
+    { "min-buffer", required_argument, NULL, 'b' },
+    { "max-buffer", required_argument, NULL, 'B' },
+    { "cache", required_argument, NULL, 'c' },
+    { "file", required_argument, NULL, 'f' },
+    { "methods", required_argument, NULL, 'm' },
+    { "runs", required_argument, NULL, 'n' },
+    { "output", required_argument, NULL, 'o' },
+    { "sync", no_argument, NULL, 's' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  memset(&options, 0, sizeof(options));
+  options.min_buffer = MIN_BUFFER_SIZE;
+  options.max_buffer = MAX_BUFFER_SIZE;
+  options.runs = 1;
+  options.cache = BENCH_DROP;
+  options.target = TEMP_TARGET;
+  parse_methods("rw,mmap,copy_file_range", &options);
+
+  while ((ch = getopt_long(argc, argv, short_options, long_options,
+                           NULL)) != -1) {
+    switch (ch) {
+      case 'b':
+        options.min_buffer = parse_size(optarg);
+        break;
+      case 'B':
+        options.max_buffer = parse_size(optarg);
+        break;
+      case 'c':
+        for (i = 0; i < 3 && strcmp(optarg, cache_names[i]) != 0; i++);
+        if (i == 3) {
+          fprintf(stderr, "%s: unknown cache mode %s\n", *argv, optarg);
+          usage(*argv);
+        }
+        options.cache = i;
+        break;
+      case 'f':
+        if ((output = fopen(optarg, "w")) == NULL) {
+          die("Cannot open ", optarg);
+        }
+        break;
+      case 'm':
+        parse_methods(optarg, &options);
+        break;
+      case 'n':
+        options.runs = parse_count(optarg, "runs", MAX_RUNS);
+        break;
+      case 'o':
+        options.target = optarg;
+        break;
+      case 's':
+        options.sync = 1;
+        break;
+      default:
+        usage(*argv);
+    }
+  }
+
+  if (optind == argc) {
+    usage(*argv);
+  }
+
+  fprintf(output, "file,file_size,method,buffer_size,run,cache,seconds,"
+          "mb_per_s,syscalls,user_seconds,system_seconds\n");
+
+  for (i = optind; i < argc; i++) {
+    bench_file(argv[i], &options, output);
+  }
+
+  unlink(options.target);
+  fclose(output);
+
+  return 0;
+}
+
+/**
+ * Runs every method and buffer size on one source file
+ */
+void bench_file(char *source, bench_options *options, FILE *output) {
+  int source_fd;
+  struct stat source_stat;
+  size_t buffer_size;
+  int method;
+  int run;
+  int failed;
+
+  if ((source_fd = open(source, O_RDONLY)) == -1) {
+    die("Cannot open ", source);
+  }
+
+  if (fstat(source_fd, &source_stat) == -1) {
+    die("Cannot stat ", source);
+  }
+
+  for (method = METHOD_COPY_FILE_RANGE; method < NUM_METHODS; method++) {
+    if (!options->methods[method]) {
+      continue;
+    }
+
+    failed = 0;
+
+    // the kernel methods have no buffer: one size is enough
+    if (method < METHOD_READ_WRITE) {
+      for (run = 1; run <= options->runs && !failed; run++) {
+        failed = run_once(source, source_fd, source_stat.st_size, method, 0,
+                          run, options, output);
+      }
+    } else {
+        for (buffer_size = options->min_buffer;
+             buffer_size <= options->max_buffer && !failed;
+             buffer_size *= 2) {
+          // a window smaller than a page is a page
+          if (method == METHOD_MMAP &&
+              buffer_size < (size_t) getpagesize()) {
+            continue;
+          }
+
+          for (run = 1; run <= options->runs && !failed; run++) {
+            failed = run_once(source, source_fd, source_stat.st_size,
+                              method, buffer_size, run, options, output);
+          }
+        }
+    }
+
+    if (failed) {
+      fprintf(stderr, "%s: skipped for %s: %s\n", method_names[method],
+              source, strerror(errno));
+    }
+  }
+
+  close(source_fd);
+}
+
+/**
+ * Puts the page cache in the state asked for before a run
+ */
+void prepare_cache(char *source, int source_fd, bench_options *options) {
+  char buffer[64 * 1024];
+  off_t offset = 0;
+  ssize_t n_chars;
+
+  if (options->cache == BENCH_DROP) {
+    // without root, /proc/sys/vm/drop_caches is out of reach, but the
+    // pages of one file can be dropped; dirty pages must be written first
+    posix_fadvise(source_fd, 0, 0, POSIX_FADV_DONTNEED);
+  } else if (options->cache == BENCH_WARM) {
+    while ((n_chars = pread(source_fd, buffer, sizeof(buffer),
+                            offset)) > 0) {
+      offset += n_chars;
+    }
+    if (n_chars == -1) {
+      die("Read error from ", source);
+    }
+  }
+}
+
+/**
+ * Returns the CPU time of a rusage field in seconds
+ */
+double seconds_of(struct timeval *time) {
+  return time->tv_sec + time->tv_usec / 1e6;
+}
+
+/**
+ * Writes to label the methods the bytes of a copy went through, joined
+ * by '+' if there were several, or the method asked for if none
+ */
+void used_methods(copy_engine *engine, copy_method method, char *label,
+                  size_t size) {
+  size_t length = 0;
+  int i;
+
+  label[0] = '\0';
+  for (i = METHOD_COPY_FILE_RANGE; i < NUM_METHODS; i++) {
+    if (engine->bytes_by_method[i] > 0 && length < size) {
+      length += snprintf(label + length, size - length, "%s%s",
+                         (length > 0) ? "+" : "", method_names[i]);
+    }
+  }
+
+  if (length == 0) {
+    snprintf(label, size, "%s", method_names[method]);
+  }
+}
+
+/**
+ * Copies the source once and writes the CSV line of the run
+ * @return: 0 on success
+ *          -1 if the method cannot copy this file, with errno set
+ */
+int run_once(char *source, int source_fd, off_t length, copy_method method,
+             size_t buffer_size, int run, bench_options *options,
+             FILE *output) {
+  copy_engine engine;
+  char label[128];
+  int error;
+  struct rusage usage_before;
+  struct rusage usage_after;
+  struct timespec start;
+  struct timespec end;
+  double elapsed;
+  int target_fd;
+
+  if ((target_fd = open(options->target, O_RDWR | O_CREAT | O_TRUNC,
+                        0644)) == -1) {
+    die("Cannot creat ", options->target);
+  }
+
+  if (engine_init(&engine, method, buffer_size ? buffer_size
+                                               : DEFAULT_BUFFER_SIZE) == -1) {
+    fprintf(stderr, "Could not allocate memory for buffer.\n");
+    exit(1);
+  }
+  engine.window_size = buffer_size;
+
+  if (length > 0 && ftruncate(target_fd, length) == -1) {
+    die("Cannot set size of ", options->target);
+  }
+
+  prepare_cache(source, source_fd, options);
+
+  getrusage(RUSAGE_SELF, &usage_before);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (engine_copy_range(&engine, source_fd, target_fd, 0, length) == -1) {
+    if (!method_unsupported(error = errno)) {
+      die("Copy error to ", options->target);
+    }
+    engine_free(&engine);
+    close(target_fd);
+    errno = error;
+    return -1;
+  }
+
+  if (options->sync) {
+    engine.syscalls++;
+    fdatasync(target_fd);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  getrusage(RUSAGE_SELF, &usage_after);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  used_methods(&engine, method, label, sizeof(label));
+
+  fprintf(output, "%s,%lld,%s,%zu,%d,%s,%.6f,%.2f,%lld,%.6f,%.6f\n", source,
+          (long long) length, label, buffer_size, run,
+          cache_names[options->cache], elapsed,
+          elapsed > 0 ? length / elapsed / 1e6 : 0.0, engine.syscalls,
+          seconds_of(&usage_after.ru_utime) -
+              seconds_of(&usage_before.ru_utime),
+          seconds_of(&usage_after.ru_stime) -
+              seconds_of(&usage_before.ru_stime));
+  fflush(output);
+
+  engine_free(&engine);
+
+  // the target must not stay in the cache for the next run either
+  if (options->cache == BENCH_DROP) {
+    fdatasync(target_fd);
+    posix_fadvise(target_fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+
+  close(target_fd);
+
+  return 0;
+}
+
+/**
+ * Turns a comma separated list of method names into options->methods
+ */
+void parse_methods(char *list, bench_options *options) {
+  char *copy = strdup(list);
+  char *name;
+  int method;
+
+  memset(options->methods, 0, sizeof(options->methods));
+
+  for (name = strtok(copy, ","); name != NULL; name = strtok(NULL, ",")) {
+    if ((method = method_from_name(name)) == -1 || method == METHOD_AUTO) {
+      fprintf(stderr, "unknown method %s\n", name);
+      exit(1);
+    }
+    options->methods[method] = 1;
+  }
+
+  free(copy);
+}
+
+/**
+ * Converts a size such as 4096, 64K, 16M or 1G to a number of bytes
+ */
+size_t parse_size(char *string) {
+  char *end_ptr;
+  unsigned long long size;
+
+  errno = 0;
+  size = strtoull(string, &end_ptr, 0);
+
+  switch (*end_ptr) {
+    case 'k': case 'K': size <<= 10; end_ptr++; break;
+    case 'm': case 'M': size <<= 20; end_ptr++; break;
+    case 'g': case 'G': size <<= 30; end_ptr++; break;
+  }
+
+  if (errno != 0 || size == 0 || *end_ptr != '\0') {
+    fprintf(stderr, "usage: size must be a positive number: %s\n", string);
+    exit(1);
+  }
+
+  return (size_t) size;
+}
+
+/**
+ * Converts a count such as the number of runs, which must be from 1 to max
+ */
+int parse_count(char *string, char *what, int max) {
+  char *end_ptr;
+  long count;
+
+  errno = 0;
+  count = strtol(string, &end_ptr, 10);
+
+  if (errno != 0 || *end_ptr != '\0' || count < 1 || count > max) {
+    fprintf(stderr, "usage: %s must be from 1 to %d: %s\n", what, max,
+            string);
+    exit(1);
+  }
+
+  return (int) count;
+}
+
+void usage(char *program_name) {
+  fprintf(stderr, "usage: %s [-s] [-b minbuffer] [-B maxbuffer] [-n runs]\n"
+          "       [-c drop|warm|keep] [-m method,...] [-o scratchfile]"
+          " [-f csvfile]\n       source...\n", program_name);
+  exit(1);
+}
+
+void die(char *string_1, char *string_2) {
+  fprintf(stderr, "Error: %s ", string_1);
+  perror(string_2);
+  exit(1);
+}
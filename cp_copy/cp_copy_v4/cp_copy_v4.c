@@ -0,0 +1,831 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// version 4, a faster cp built on the lessons of versions 1 to 3:
+// the data is copied by the kernel when the file systems allow it
+// and falls back to the read/write loop of version 2 otherwise.
+// Large files can be copied by several threads, so link with -pthread.
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "copy_engine.h"
+#include "sparse.h"
+#include "page_cache.h"
+#include "reflink.h"
+#include "parallel_copy.h"
+#include "tree_copy.h"
+#include "delta_copy.h"
+#include "resume.h"
+#include "dir_cache.h"
+
+#define COPY_MODE 0644
+#define DEFAULT_STATS_INTERVAL 5.0 // seconds between progress lines
+#define MAX_THREADS 1024 // -j, more would only pile up on the devices
+
+typedef struct _copy_options {
+  copy_method method; // -m, how the data is moved
+  size_t buffer_size; // -b, size of the read/write buffer
+  reflink_mode reflink; // --reflink, share blocks instead of copying
+  sparse_mode sparse; // --sparse, how holes and zeros are handled
+  size_t window_size; // -w, bytes of each file mapped at a time by mmap
+  int num_threads; // -j, threads copying chunks of one file
+  off_t chunk_size; // --chunk-size, bytes each thread copies at a time
+  unsigned queue_depth; // -q, buffers in flight with io_uring or pipeline
+  int recursive; // -r, copy directories and what is in them
+  checksum_type checksum; // --checksum, digest of the data copied
+  int verify; // --verify, read the target back and compare digests
+  int delta; // --delta, only write what differs from the existing target
+  size_t block_size; // --block-size, bytes of target compared at a time
+  cache_mode cache; // --direct or --drop-cache, keep the copy out of cache
+  char *manifest; // --manifest, file of source and destination pairs
+  int resume; // --resume, carry on from where an interrupted copy stopped
+  char *journal; // journal of the target being copied, with --resume
+  copy_stats *stats; // --stats, NULL when off
+  int verbose; // -v, report which method was used
+} copy_options;
+
+void die(char *string_1, char *string_2); // print error and quit
+void usage(char *program_name);
+size_t parse_size(char *string);
+int parse_count(char *string, char *what, int max);
+int setup_engine(copy_engine *engine, void *arg);
+int target_flags(copy_options *options);
+off_t copy_data(copy_engine *engine, int source_fd, int target_fd,
+                struct stat *source_stat, copy_options *options);
+int copy_and_check(copy_engine *engine, const char *name, int source_fd,
+                   int target_fd, struct stat *source_stat,
+                   copy_options *options, char *digest);
+int copy_contents(copy_engine *engine, const char *name, int source_fd,
+                  int target_fd, struct stat *source_stat, void *arg);
+void copy_file(char *source, char *target, copy_options *options);
+void copy_directory(char *source, char *target, copy_options *options);
+int copy_entry(copy_engine *engine, dir_cache *dirs, char *source,
+               char *target, copy_options *options, struct stat *source_stat,
+               char *digest, char **failed);
+void copy_manifest(char *manifest, copy_options *options);
+void report_stats(void);
+
+// --stats: shared by every engine, and printed by report_stats() at exit,
+// which atexit() calls without arguments
+static copy_stats stats;
+static char *stats_json = NULL; // --stats-json, the file for the JSON
+
+int main(int argc, char *argv[]) {
+  copy_options options;
+  int ch;
+  int method;
+  int reflink;
+  int sparse;
+  int checksum;
+  double interval = -1; // no --stats
+  char *end_ptr;
+  char short_options[] = "b:j:m:q:rvw:";
+  struct stat source_stat;
+  int threads_given = 0;
+  struct option long_options[] = {
+    { "block-size", required_argument, NULL, 'B' },
+    { "buffer-size", required_argument, NULL, 'b' },
+    { "checksum", required_argument, NULL, 'c' },
+    { "chunk-size", required_argument, NULL, 'C' },
+    { "delta", no_argument, NULL, 'D' },
+    { "direct", no_argument, NULL, 'O' },
+    { "drop-cache", no_argument, NULL, 'P' },
+    { "jobs", required_argument, NULL, 'j' },
+    { "manifest", required_argument, NULL, 'M' },
+    { "method", required_argument, NULL, 'm' },
+    { "queue-depth", required_argument, NULL, 'q' },
+    { "recursive", no_argument, NULL, 'r' },
+    { "reflink", optional_argument, NULL, 'R' },
+    { "resume", no_argument, NULL, 'T' },
+    { "sparse", required_argument, NULL, 'S' },
+    { "stats", optional_argument, NULL, 'I' },
+    { "stats-json", required_argument, NULL, 'J' },
+    { "verbose", no_argument, NULL, 'v' },
+    { "verify", no_argument, NULL, 'V' },
+    { "window", required_argument, NULL, 'w' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  options.method = METHOD_AUTO;
+  options.buffer_size = DEFAULT_BUFFER_SIZE;
+  options.reflink = REFLINK_AUTO;
+  options.sparse = SPARSE_AUTO;
+  options.window_size = DEFAULT_WINDOW_SIZE;
+  options.num_threads = 1;
+  options.chunk_size = DEFAULT_CHUNK_SIZE;
+  options.queue_depth = DEFAULT_QUEUE_DEPTH;
+  options.recursive = 0;
+  options.checksum = CHECKSUM_NONE;
+  options.verify = 0;
+  options.delta = 0;
+  options.block_size = DEFAULT_DELTA_BLOCK;
+  options.cache = CACHE_KEEP;
+  options.manifest = NULL;
+  options.resume = 0;
+  options.journal = NULL;
+  options.stats = NULL;
+  options.verbose = 0;
+
+  while ((ch = getopt_long(argc, argv, short_options, long_options,
+                           NULL)) != -1) {
+    switch (ch) {
+      case 'b':
+        options.buffer_size = parse_size(optarg);
+        break;
+      case 'B':
+        options.block_size = parse_size(optarg);
+        break;
+      case 'c':
+        if ((checksum = checksum_from_name(optarg)) == -1) {
+          fprintf(stderr, "%s: unknown checksum %s\n", *argv, optarg);
+          usage(*argv);
+        }
+        options.checksum = checksum;
+        break;
+      case 'C':
+        options.chunk_size = parse_size(optarg);
+        break;
+      case 'D':
+        options.delta = 1;
+        break;
+      case 'O':
+        options.cache = CACHE_DIRECT;
+        break;
+      case 'P':
+        options.cache = CACHE_DROP;
+        break;
+      case 'j':
+        options.num_threads = parse_count(optarg, "threads", MAX_THREADS);
+        threads_given = 1;
+        break;
+      case 'M':
+        options.manifest = optarg;
+        break;
+      case 'm':
+        if ((method = method_from_name(optarg)) == -1) {
+          fprintf(stderr, "%s: unknown method %s\n", *argv, optarg);
+          usage(*argv);
+        }
+        options.method = method;
+        break;
+      case 'q':
+        options.queue_depth = parse_count(optarg, "queue depth",
+                                          MAX_QUEUE_DEPTH);
+        break;
+      case 'r':
+        options.recursive = 1;
+        break;
+      case 'R':
+        if ((reflink = reflink_from_name(optarg)) == -1) {
+          fprintf(stderr, "%s: unknown reflink mode %s\n", *argv, optarg);
+          usage(*argv);
+        }
+        options.reflink = reflink;
+        break;
+      case 'T':
+        options.resume = 1;
+        break;
+      case 'S':
+        if ((sparse = sparse_from_name(optarg)) == -1) {
+          fprintf(stderr, "%s: unknown sparse mode %s\n", *argv, optarg);
+          usage(*argv);
+        }
+        options.sparse = sparse;
+        break;
+      case 'I':
+        interval = DEFAULT_STATS_INTERVAL;
+        if (optarg != NULL) {
+          interval = strtod(optarg, &end_ptr);
+          if (*end_ptr != '\0' || interval < 0) {
+            fprintf(stderr, "%s: bad stats interval %s\n", *argv, optarg);
+            usage(*argv);
+          }
+        }
+        break;
+      case 'J':
+        stats_json = optarg;
+        break;
+      case 'v':
+        options.verbose = 1;
+        break;
+      case 'V':
+        options.verify = 1;
+        break;
+      case 'w':
+        options.window_size = parse_size(optarg);
+        break;
+      default:
+        usage(*argv);
+    }
+  }
+
+  if (argc - optind != (options.manifest != NULL ? 0 : 2)) {
+    usage(*argv);
+  }
+
+  if (options.verify && options.checksum == CHECKSUM_NONE) {
+    options.checksum = CHECKSUM_CRC32C;
+  }
+
+  // a clone shares the blocks without reading them, so there would be
+  // nothing to checksum
+  if (options.checksum != CHECKSUM_NONE) {
+    if (options.reflink == REFLINK_ALWAYS) {
+      fprintf(stderr, "%s: --checksum cannot be used with --reflink=always\n",
+              *argv);
+      exit(1);
+    }
+    options.reflink = REFLINK_NEVER;
+  }
+
+  // the delta is computed from memory maps and written at any offset
+  if (options.delta && options.cache == CACHE_DIRECT) {
+    fprintf(stderr, "%s: --direct cannot be used with --delta\n", *argv);
+    exit(1);
+  }
+
+  if (options.resume && options.delta) {
+    fprintf(stderr, "%s: --resume cannot be used with --delta\n", *argv);
+    exit(1);
+  }
+
+  // chunks must start on a block boundary for O_DIRECT
+  if (options.cache == CACHE_DIRECT) {
+    options.chunk_size = (options.chunk_size + getpagesize() - 1) /
+                         getpagesize() * getpagesize();
+  }
+
+  // before any other thread starts, see copy_stats.h
+  if (interval >= 0 || stats_json != NULL) {
+    stats_init(&stats);
+    options.stats = &stats;
+    if (interval >= 0 && stats_start_reporter(&stats, interval) == -1) {
+      die("Cannot start the stats reporter", "");
+    }
+    atexit(report_stats);
+  }
+
+  if (options.manifest != NULL) {
+    copy_manifest(options.manifest, &options);
+  } else if (options.recursive &&
+      stat(argv[optind], &source_stat) == 0 && S_ISDIR(source_stat.st_mode)) {
+    // a journal is kept per target file, by copy_file() and copy_entry()
+    if (options.resume) {
+      fprintf(stderr, "%s: --resume cannot be used with directories\n",
+              *argv);
+      exit(1);
+    }
+    // with -r, -j is the number of threads copying files of the tree
+    if (!threads_given) {
+      options.num_threads = DEFAULT_TREE_WORKERS;
+    }
+    copy_directory(argv[optind], argv[optind + 1], &options);
+  } else {
+    copy_file(argv[optind], argv[optind + 1], &options);
+  }
+
+  return 0;
+}
+
+/**
+ * Prepares an engine as selected by the options
+ * @return: 0 on success
+ *          -1 if the buffer could not be allocated
+ */
+int setup_engine(copy_engine *engine, void *arg) {
+  copy_options *options = (copy_options*) arg;
+
+  if (engine_init(engine, options->method, options->buffer_size) == -1) {
+    return -1;
+  }
+
+  engine->window_size = options->window_size;
+  engine->queue_depth = options->queue_depth;
+  engine->stats = options->stats;
+
+  if (engine_set_cache(engine, options->cache) == -1) {
+    engine_free(engine);
+    return -1;
+  }
+
+  // the target is always truncated first, so it has no old data to punch
+  engine_set_sparse(engine, options->sparse, 0);
+
+  return 0;
+}
+
+/**
+ * open() flags of a target: same as creat(), but with O_CLOEXEC;
+ * a memory-mapped target must be readable too, see cp_copy_v3,
+ * and so must a target that is read back to verify it.
+ * With --delta the old contents are kept and read to be compared, and
+ * with --resume the part already copied is kept and its end checked.
+ */
+int target_flags(copy_options *options) {
+  return O_CREAT | O_CLOEXEC |
+         ((options->delta || options->resume) ? 0 : O_TRUNC) |
+         ((options->method == METHOD_MMAP || options->verify ||
+           options->delta || options->resume) ? O_RDWR : O_WRONLY);
+}
+
+/**
+ * Copies the data of an open file to an open target, which is empty
+ * unless --delta or --resume was given
+ * @return: number of bytes copied
+ *          -1 on error
+ */
+off_t copy_data(copy_engine *engine, int source_fd, int target_fd,
+                struct stat *source_stat, copy_options *options) {
+  delta_stats stats;
+  struct stat target_stat;
+  off_t resumed_from;
+  off_t length;
+
+  // only regular files have a size we can trust;
+  // anything else is read until end of file
+  length = S_ISREG(source_stat->st_mode) ? source_stat->st_size : -1;
+
+  // a FIFO, a device or a terminal cannot be sized, mapped or left with
+  // holes, and has no old data: the data is streamed to it, as in
+  // cp_copy_v1
+  if (fstat(target_fd, &target_stat) == -1) {
+    return -1;
+  } else if (!S_ISREG(target_stat.st_mode)) {
+      return engine_copy_range(engine, source_fd, target_fd, 0, -1);
+  }
+
+  if (options->method == METHOD_MMAP && length < 0) {
+    errno = EINVAL; // cannot memory-map a file of unknown size
+    return -1;
+  }
+
+  if (options->delta && length > 0 && target_stat.st_size > 0) {
+    length = delta_copy(engine, source_fd, target_fd, length,
+                        options->block_size, &stats);
+    if (length != -1 && options->verbose) {
+      fprintf(stderr, "delta: %lld blocks of the target, %lld in place, "
+              "%lld shifted, %lld bytes written\n", (long long) stats.blocks,
+              (long long) stats.in_place, (long long) stats.shifted,
+              (long long) stats.bytes_written);
+    }
+    return length;
+  } else if (options->resume && length > 0) {
+    length = resume_copy(engine, source_fd, target_fd, length, source_stat,
+                         options->journal, &resumed_from);
+    if (length != -1 && resumed_from > 0 && options->verbose) {
+      fprintf(stderr, "resumed at byte %lld of %lld\n",
+              (long long) resumed_from, (long long) length);
+    }
+    return length;
+  } else if ((options->delta || options->resume) &&
+             ftruncate(target_fd, 0) == -1) {
+    // no old data to compare with, or nothing to resume: a plain copy
+    return -1;
+  }
+
+  // Give the target its final size up front. Nothing is allocated by this,
+  // so the holes of the source stay holes in the target, and the memory
+  // map has something to map. It replaces the lseek() and one byte write()
+  // of cp_copy_v3.
+  if (length > 0 && ftruncate(target_fd, length) == -1) {
+    return -1;
+  }
+
+  // checksums need the data in order, so one thread
+  if (options->num_threads > 1 && length > options->chunk_size &&
+      !options->recursive && options->checksum == CHECKSUM_NONE) {
+    // a big file: clone it if possible, else copy its chunks in parallel
+    if (options->reflink != REFLINK_NEVER &&
+        reflink_whole_file(engine, source_fd, target_fd, length) == 0) {
+      return length;
+    } else if (options->reflink == REFLINK_ALWAYS) {
+      return -1;
+    }
+
+    preallocate(engine, target_fd, source_stat);
+    return parallel_copy(engine, source_fd, target_fd, length,
+                         options->num_threads, options->chunk_size);
+  }
+
+  // the target was just truncated, so its blocks can be shared with the
+  // source; whatever cannot be shared is copied by the engine
+  return reflink_copy(engine, options->reflink, source_fd, target_fd, length);
+}
+
+/**
+ * Copies the contents of an open file to an open, empty target, and
+ * computes and verifies its checksum if asked to. The checksum is written
+ * to digest, which must have room for 17 characters; it is left empty
+ * when there is none.
+ * @return: 0 on success
+ *          -1 on error, with errno EIO if the target does not match
+ */
+int copy_and_check(copy_engine *engine, const char *name, int source_fd,
+                   int target_fd, struct stat *source_stat,
+                   copy_options *options, char *digest) {
+  checksum source_sum;
+  checksum target_sum;
+  char target_digest[17];
+  off_t length;
+
+  if (options->cache == CACHE_DIRECT) {
+    engine_open_direct(engine, source_fd, target_fd, source_stat);
+  }
+
+  digest[0] = '\0';
+  if (options->checksum == CHECKSUM_NONE) {
+    return copy_data(engine, source_fd, target_fd, source_stat,
+                     options) == -1 ? -1 : 0;
+  }
+
+  checksum_init(&source_sum, options->checksum);
+  engine->sum = &source_sum;
+  length = copy_data(engine, source_fd, target_fd, source_stat, options);
+  engine->sum = NULL;
+
+  if (length == -1) {
+    return -1;
+  }
+  checksum_final(&source_sum, length, digest);
+
+  if (options->verify) {
+    checksum_init(&target_sum, options->checksum);
+    if (engine_checksum_file(engine, target_fd, &target_sum) == -1) {
+      return -1;
+    }
+    checksum_final(&target_sum, target_sum.offset, target_digest);
+
+    if (strcmp(digest, target_digest) != 0 ||
+        target_sum.offset != length) {
+      fprintf(stderr, "%s: verify failed, copy has checksum %s\n", name,
+              target_digest);
+      errno = EIO;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Copies the contents of an open file to an open, empty target, and
+ * prints its checksum if asked to; the callback of copy_tree()
+ * @return: 0 on success
+ *          -1 on error
+ */
+int copy_contents(copy_engine *engine, const char *name, int source_fd,
+                  int target_fd, struct stat *source_stat, void *arg) {
+  char digest[17];
+
+  if (copy_and_check(engine, name, source_fd, target_fd, source_stat,
+                     (copy_options*) arg, digest) == -1) {
+    return -1;
+  }
+
+  // the format of sha256sum and friends
+  if (digest[0] != '\0') {
+    printf("%s  %s\n", digest, name);
+  }
+
+  return 0;
+}
+
+/**
+ * Copies one file with the engine selected by the options
+ */
+void copy_file(char *source, char *target, copy_options *options) {
+  int source_fd;
+  int target_fd;
+  struct stat source_stat;
+  copy_engine engine;
+
+  // try to open file with read only persmission
+  if ((source_fd = open(source, O_RDONLY)) == -1) {
+    die("Cannot open ", source);
+  }
+
+  if (fstat(source_fd, &source_stat) == -1) {
+    die("Cannot stat ", source);
+  }
+
+  if ((target_fd = open(target, target_flags(options), COPY_MODE)) == -1) {
+    die("Cannot creat ", target);
+  }
+
+  if (setup_engine(&engine, options) == -1) {
+    fprintf(stderr, "Could not allocate memory for buffer.\n");
+    exit(1);
+  }
+
+  if (options->resume && (options->journal = journal_path(target)) == NULL) {
+    die("Out of memory", "");
+  }
+
+  if (copy_contents(&engine, source, source_fd, target_fd, &source_stat,
+                    options) == -1) {
+    if (options->reflink == REFLINK_ALWAYS) {
+      die("Cannot clone to ", target);
+    }
+    die("Copy error to ", target);
+  }
+
+  if (options->verbose) {
+    engine_report(&engine, source);
+  }
+
+  engine_free(&engine);
+  free(options->journal);
+  options->journal = NULL;
+
+  // close both files
+  if (close(source_fd) == -1 || close(target_fd) == -1) {
+    die("Error closing files", "");
+  }
+}
+
+/**
+ * Copies the directory source and everything in it. Like cp -r, the copy
+ * is made inside target when target is an existing directory.
+ */
+void copy_directory(char *source, char *target, copy_options *options) {
+  struct stat target_stat;
+  copy_engine total;
+  char *target_path = target;
+  char *base;
+  int errors;
+
+  if (stat(target, &target_stat) == 0 && S_ISDIR(target_stat.st_mode)) {
+    base = strrchr(source, '/');
+    base = (base != NULL && base[1] != '\0') ? base + 1 : source;
+    if ((target_path = malloc(strlen(target) + strlen(base) + 2)) == NULL) {
+      die("Out of memory", "");
+    }
+    sprintf(target_path, "%s/%s", target, base);
+  }
+
+  memset(&total, 0, sizeof(copy_engine));
+  errors = copy_tree(source, target_path, options->num_threads,
+                     target_flags(options), setup_engine, copy_contents,
+                     options, &total);
+
+  if (errors == -1 && errno == EINVAL) {
+    fprintf(stderr, "Error: cannot copy %s into itself, %s\n", source,
+            target_path);
+    exit(1);
+  } else if (errors == -1) {
+      die("Cannot copy directory ", source);
+  }
+
+  if (options->verbose) {
+    engine_report(&total, source);
+  }
+
+  if (target_path != target) {
+    free(target_path);
+  }
+
+  if (errors > 0) {
+    exit(1);
+  }
+}
+
+/**
+ * Copies one entry of a manifest, opening both files relative to their
+ * directories, which are kept open in dirs for the next entries
+ * @return: 0 on success
+ *          -1 on error, with failed set to what could not be done
+ */
+int copy_entry(copy_engine *engine, dir_cache *dirs, char *source,
+               char *target, copy_options *options, struct stat *source_stat,
+               char *digest, char **failed) {
+  const char *name;
+  int directory_fd;
+  int source_fd;
+  int target_fd;
+  int result;
+  int error;
+
+  // a method given up on for the last pair of files may work for this one
+  engine->next_method = (engine->method == METHOD_AUTO)
+                            ? METHOD_COPY_FILE_RANGE : engine->method;
+
+  *failed = "Cannot open";
+  if ((directory_fd = dir_cache_lookup(dirs, source, &name)) == -1 ||
+      (source_fd = openat(directory_fd, name, O_RDONLY | O_CLOEXEC)) == -1) {
+    return -1;
+  }
+
+  *failed = "Cannot stat";
+  if (fstat(source_fd, source_stat) == -1) {
+    close(source_fd);
+    return -1;
+  } else if (S_ISDIR(source_stat->st_mode)) {
+    *failed = "Cannot copy";
+    close(source_fd);
+    errno = EISDIR;
+    return -1;
+  }
+
+  *failed = "Cannot creat";
+  if ((directory_fd = dir_cache_lookup(dirs, target, &name)) == -1 ||
+      (target_fd = openat(directory_fd, name, target_flags(options),
+                          COPY_MODE)) == -1) {
+    close(source_fd);
+    return -1;
+  }
+
+  *failed = "Copy error";
+  if (options->resume && (options->journal = journal_path(target)) == NULL) {
+    result = -1;
+  } else {
+    result = copy_and_check(engine, source, source_fd, target_fd,
+                            source_stat, options, digest);
+  }
+  error = errno;
+  free(options->journal);
+  options->journal = NULL;
+
+  if (close(source_fd) == -1 || close(target_fd) == -1) {
+    *failed = "Error closing files";
+    return -1;
+  }
+
+  errno = error;
+  return result;
+}
+
+/**
+ * Copies every pair of files listed in a manifest, "-" being the standard
+ * input, in this one process: the engine and its buffers, and the open
+ * directories, are reused from one pair to the next. Each line holds a
+ * source and a destination separated by a tab; empty lines and lines
+ * starting with # are skipped. For each pair one line is written and
+ * flushed on the standard output as soon as it is done, fields separated
+ * by tabs:
+ *   ok     source  destination  bytes  [checksum]
+ *   error  source  destination  message
+ * Exits with status 1 if any pair failed.
+ */
+void copy_manifest(char *manifest, copy_options *options) {
+  FILE *input = stdin;
+  copy_engine engine;
+  dir_cache dirs;
+  struct stat source_stat;
+  char digest[17];
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  char *target;
+  char *failed;
+  int errors = 0;
+
+  if (strcmp(manifest, "-") != 0 && (input = fopen(manifest, "r")) == NULL) {
+    die("Cannot open ", manifest);
+  }
+
+  if (setup_engine(&engine, options) == -1) {
+    fprintf(stderr, "Could not allocate memory for buffer.\n");
+    exit(1);
+  }
+  dir_cache_init(&dirs);
+
+  while ((length = getline(&line, &size, input)) != -1) {
+    if (length > 0 && line[length - 1] == '\n') {
+      line[--length] = '\0';
+    }
+    if (length == 0 || line[0] == '#') {
+      continue;
+    }
+
+    if ((target = strchr(line, '\t')) == NULL) {
+      printf("error\t%s\t\tno tab between source and destination\n", line);
+      errors++;
+    } else {
+      *target++ = '\0';
+      if (copy_entry(&engine, &dirs, line, target, options, &source_stat,
+                     digest, &failed) == -1) {
+        printf("error\t%s\t%s\t%s: %s\n", line, target, failed,
+               strerror(errno));
+        errors++;
+      } else {
+        printf("ok\t%s\t%s\t%lld%s%s\n", line, target,
+               (long long) source_stat.st_size, digest[0] ? "\t" : "",
+               digest);
+      }
+    }
+    fflush(stdout); // the caller may be reading the results as they come
+  }
+
+  if (ferror(input)) {
+    die("Read error from ", manifest);
+  }
+
+  if (options->verbose) {
+    engine_report(&engine, manifest);
+    fprintf(stderr, "%s: %lld directory opens saved\n", manifest,
+            dirs.hits);
+  }
+
+  free(line);
+  dir_cache_free(&dirs);
+  engine_free(&engine);
+  if (input != stdin) {
+    fclose(input);
+  }
+
+  if (errors > 0) {
+    exit(1);
+  }
+}
+
+/**
+ * Stops the progress lines of --stats and writes the statistics as JSON
+ * to stderr, or to the file given with --stats-json. Called at exit,
+ * whether the copy succeeded or not.
+ */
+void report_stats(void) {
+  FILE *output = stderr;
+
+  stats_stop_reporter(&stats);
+
+  if (stats_json != NULL && (output = fopen(stats_json, "w")) == NULL) {
+    perror(stats_json);
+    return;
+  }
+
+  stats_print_json(&stats, output);
+
+  if (output != stderr) {
+    fclose(output);
+  }
+}
+
+/**
+ * Converts a size such as 4096, 64K, 16M or 1G to a number of bytes
+ */
+size_t parse_size(char *string) {
+  char *end_ptr;
+  unsigned long long size;
+
+  errno = 0;
+  size = strtoull(string, &end_ptr, 0);
+
+  switch (*end_ptr) {
+    case 'k': case 'K': size <<= 10; end_ptr++; break;
+    case 'm': case 'M': size <<= 20; end_ptr++; break;
+    case 'g': case 'G': size <<= 30; end_ptr++; break;
+  }
+
+  if (errno != 0 || size == 0 || *end_ptr != '\0') {
+    fprintf(stderr, "usage: size must be a positive number: %s\n", string);
+    exit(1);
+  }
+
+  return (size_t) size;
+}
+
+/**
+ * Converts a count such as the number of threads, which must be from 1 to
+ * max
+ */
+int parse_count(char *string, char *what, int max) {
+  char *end_ptr;
+  long count;
+
+  errno = 0;
+  count = strtol(string, &end_ptr, 10);
+
+  if (errno != 0 || *end_ptr != '\0' || count < 1 || count > max) {
+    fprintf(stderr, "usage: %s must be from 1 to %d: %s\n", what, max,
+            string);
+    exit(1);
+  }
+
+  return (int) count;
+}
+
+void usage(char *program_name) {
+  fprintf(stderr, "usage: %s [-rv] [-b buffersize] [-w windowsize]\n"
+          "       [-m auto|copy_file_range|sendfile|splice|rw|mmap|uring|"
+          "pipeline]\n"
+          "       [--reflink[=auto|always|never]] [--sparse=auto|always|never]"
+          "\n       [-j threads] [--chunk-size size] [-q queuedepth]"
+          "\n       [--checksum=crc32c|xxh64] [--verify]"
+          " [--delta [--block-size size]]\n       [--direct|--drop-cache]"
+          " [--resume] [--stats[=seconds]] [--stats-json=file]\n"
+          "       source destination\n"
+          "       %s [options] --manifest=file|-\n",
+          program_name, program_name);
+  exit(1);
+}
+
+void die(char *string_1, char *string_2) {
+  fprintf(stderr, "Error: %s ", string_1);
+  perror(string_2);
+  exit(1);
+}
@@ -0,0 +1,308 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// incremental copy onto an existing target, used by cp_copy_v4 --delta
+//
+// When the target is an older copy of the source, most of its blocks are
+// already right. This is the rsync algorithm, applied to two local files:
+//   1. the target is cut into blocks, and each block gets a weak checksum,
+//      cheap to compute, and a strong one (xxh64), unlikely to collide.
+//   2. a window of one block slides over the source one byte at a time.
+//      The weak checksum is "rolling": moving the window by one byte only
+//      takes the byte that leaves and the byte that enters, so it costs the
+//      same whatever the block size. When the weak checksum of the window
+//      is that of a target block, the strong checksum confirms the match.
+//   3. the source is then the target blocks it matches, plus literal bytes.
+// The target is updated in place, so a block that is found again at its
+// own offset is not written at all. A block found at another offset (data
+// inserted or removed before it) still has to be written there, like any
+// literal bytes, because its old copy sits at the wrong offset; so the
+// writes are proportional to the changed and the shifted data.
+// Requires copy_engine.h (and its checksum.h).
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define DEFAULT_DELTA_BLOCK (64 * 1024) // bytes per target block
+
+typedef struct _block_signature {
+  uint32_t weak;
+  uint64_t strong;
+  int64_t next; // next block in the same hash bucket, or -1
+} block_signature;
+
+typedef struct _delta_stats {
+  off_t blocks; // blocks in the target
+  off_t in_place; // found again at their own offset, not written
+  off_t shifted; // found at another offset, written there
+  off_t bytes_written;
+} delta_stats;
+
+/**
+ * The rsync weak checksum of a block: a is the sum of the bytes and b the
+ * sum of the running values of a, both modulo 2^16
+ */
+static inline uint32_t weak_checksum(const unsigned char *data, size_t length,
+                                     uint32_t *a_out, uint32_t *b_out) {
+  uint32_t a = 0;
+  uint32_t b = 0;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    a += data[i];
+    b += (uint32_t) (length - i) * data[i];
+  }
+
+  *a_out = a & 0xffff;
+  *b_out = b & 0xffff;
+
+  return *a_out | (*b_out << 16);
+}
+
+/**
+ * Moves the window of a weak checksum one byte forward: out leaves it
+ * and in enters it
+ */
+static inline uint32_t weak_roll(uint32_t *a, uint32_t *b, size_t length,
+                                 unsigned char out, unsigned char in) {
+  *a = (*a - out + in) & 0xffff;
+  *b = (*b - (uint32_t) length * out + *a) & 0xffff;
+
+  return *a | (*b << 16);
+}
+
+/**
+ * Writes [offset, offset + length) of the source, found at source + offset,
+ * to the target
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int delta_write(copy_engine *engine, int out_fd,
+                              const unsigned char *source, off_t offset,
+                              off_t length, delta_stats *stats) {
+  struct timespec start;
+  ssize_t n;
+
+  while (length > 0) {
+    engine->syscalls++;
+    stats_start(engine->stats, &start);
+    n = pwrite(out_fd, source + offset, length, offset);
+    stats_record(engine->stats, STAT_WRITE, &start, n);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    offset += n;
+    length -= n;
+    stats->bytes_written += n;
+  }
+
+  return 0;
+}
+
+/**
+ * Computes the signature of every block of the target and chains the blocks
+ * in a hash table indexed by the weak checksum
+ * @return: the signatures, or NULL on error
+ */
+static inline block_signature *target_signatures(copy_engine *engine,
+                                                 int out_fd, off_t target_size,
+                                                 size_t block_size,
+                                                 int64_t **buckets_out,
+                                                 uint32_t *mask_out) {
+  int64_t count = (target_size + block_size - 1) / block_size;
+  block_signature *blocks;
+  int64_t *buckets;
+  unsigned char *buffer;
+  uint32_t mask = 1;
+  uint32_t a;
+  uint32_t b;
+  ssize_t n;
+  int64_t i;
+
+  while (mask < 2 * count) {
+    mask <<= 1;
+  }
+
+  blocks = malloc(count * sizeof(block_signature));
+  buckets = malloc(mask * sizeof(int64_t));
+  buffer = malloc(block_size);
+  if (blocks == NULL || buckets == NULL || buffer == NULL) {
+    free(blocks);
+    free(buckets);
+    free(buffer);
+    errno = ENOMEM;
+    return NULL;
+  }
+  mask--;
+  memset(buckets, -1, (mask + 1) * sizeof(int64_t));
+
+  // only whole blocks can match; the short last block is always rewritten
+  for (i = 0; i < count; i++) {
+    engine->syscalls++;
+    if ((n = pread(out_fd, buffer, block_size, i * block_size)) == -1) {
+      free(blocks);
+      free(buckets);
+      free(buffer);
+      return NULL;
+    }
+
+    blocks[i].weak = weak_checksum(buffer, n, &a, &b);
+    blocks[i].strong = xxh64_of(buffer, n);
+    blocks[i].next = -1;
+
+    if ((size_t) n == block_size) {
+      blocks[i].next = buckets[blocks[i].weak & mask];
+      buckets[blocks[i].weak & mask] = i;
+    }
+  }
+
+  free(buffer);
+  *buckets_out = buckets;
+  *mask_out = mask;
+
+  return blocks;
+}
+
+/**
+ * Looks for a target block equal to the window at source + offset.
+ * The block at the same offset is tried first, as it is the likely one.
+ * @return: the index of the block or -1 if none matches
+ */
+static inline int64_t find_block(block_signature *blocks, int64_t *buckets,
+                                 uint32_t mask, int64_t count,
+                                 const unsigned char *window, off_t offset,
+                                 size_t block_size, uint32_t weak) {
+  int64_t same = offset / (off_t) block_size;
+  uint64_t strong = 0;
+  int have_strong = 0;
+  int64_t i;
+
+  if (offset % (off_t) block_size == 0 && same < count &&
+      blocks[same].weak == weak) {
+    strong = xxh64_of(window, block_size);
+    have_strong = 1;
+    if (blocks[same].strong == strong) {
+      return same;
+    }
+  }
+
+  for (i = buckets[weak & mask]; i != -1; i = blocks[i].next) {
+    if (blocks[i].weak != weak) {
+      continue;
+    }
+    if (!have_strong) {
+      strong = xxh64_of(window, block_size);
+      have_strong = 1;
+    }
+    if (blocks[i].strong == strong) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Brings the existing target up to date with the source of the given length,
+ * writing only what changed, and truncates it to that length.
+ * Both files must be regular and not empty.
+ * @return: length on success
+ *          -1 on error
+ */
+static inline off_t delta_copy(copy_engine *engine, int in_fd, int out_fd,
+                               off_t length, size_t block_size,
+                               delta_stats *stats) {
+  struct stat target_stat;
+  block_signature *blocks;
+  int64_t *buckets;
+  int64_t count;
+  int64_t block;
+  uint32_t mask;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  uint32_t weak = 0;
+  unsigned char *source;
+  off_t offset = 0;
+  off_t literal = 0; // start of the source bytes still to write
+  int rolling = 0;
+  int result = 0;
+
+  memset(stats, 0, sizeof(delta_stats));
+
+  if (fstat(out_fd, &target_stat) == -1) {
+    return -1;
+  }
+
+  count = (target_stat.st_size + block_size - 1) / block_size;
+  if ((blocks = target_signatures(engine, out_fd, target_stat.st_size,
+                                  block_size, &buckets, &mask)) == NULL) {
+    return -1;
+  }
+  stats->blocks = count;
+
+  engine->syscalls += 2;
+  if ((source = mmap(NULL, length, PROT_READ, MAP_SHARED, in_fd, 0))
+      == MAP_FAILED) {
+    free(blocks);
+    free(buckets);
+    return -1;
+  }
+  madvise(source, length, MADV_SEQUENTIAL);
+
+  if (engine->sum != NULL) {
+    checksum_update(engine->sum, source, length);
+  }
+
+  while (offset + (off_t) block_size <= length && result == 0) {
+    if (!rolling) {
+      weak = weak_checksum(source + offset, block_size, &a, &b);
+      rolling = 1;
+    }
+
+    block = find_block(blocks, buckets, mask, count, source + offset, offset,
+                       block_size, weak);
+
+    if (block == -1) {
+      // no match: this byte is literal, slide the window by one
+      if (offset + (off_t) block_size < length) {
+        weak = weak_roll(&a, &b, block_size, source[offset],
+                         source[offset + block_size]);
+      }
+      offset++;
+      continue;
+    }
+
+    if (block * (off_t) block_size == offset) {
+      // already there: write the bytes before it, if any
+      stats->in_place++;
+      if (offset > literal) {
+        result = delta_write(engine, out_fd, source, literal,
+                             offset - literal, stats);
+      }
+      literal = offset + block_size;
+    } else {
+      // written with the literal bytes around it, in one pwrite()
+      stats->shifted++;
+    }
+
+    offset += block_size;
+    rolling = 0;
+  }
+
+  // whatever is left after the last block in place
+  if (result == 0 && length > literal) {
+    result = delta_write(engine, out_fd, source, literal, length - literal,
+                         stats);
+  }
+
+  engine->syscalls += 2;
+  munmap(source, length);
+  free(blocks);
+  free(buckets);
+
+  if (result == -1 || ftruncate(out_fd, length) == -1) {
+    return -1;
+  }
+
+  engine->bytes_by_method[METHOD_READ_WRITE] += stats->bytes_written;
+
+  return length;
+}
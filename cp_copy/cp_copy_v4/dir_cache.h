@@ -0,0 +1,101 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// a small cache of open directories, used by the manifest mode of
+// cp_copy_v4
+//
+// open() of "a/b/c/file" makes the kernel look up a, b and c again for
+// every file. When many files are copied to and from the same few
+// directories, it is cheaper to keep each directory open once and open
+// the files relative to it with openat(), which only looks up the last
+// name. The cache holds DIR_CACHE_SIZE directories and replaces them in
+// turn when it is full.
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DIR_CACHE_SIZE 16 // directories kept open
+
+typedef struct _cached_dir {
+  char *path; // NULL if the entry is unused
+  int fd;
+} cached_dir;
+
+typedef struct _dir_cache {
+  cached_dir dirs[DIR_CACHE_SIZE];
+  int next_victim; // entry replaced when the cache is full
+  long long hits;
+  long long misses;
+} dir_cache;
+
+static inline void dir_cache_init(dir_cache *cache) {
+  memset(cache, 0, sizeof(dir_cache));
+}
+
+/**
+ * Closes every directory of the cache
+ */
+static inline void dir_cache_free(dir_cache *cache) {
+  int i;
+
+  for (i = 0; i < DIR_CACHE_SIZE; i++) {
+    if (cache->dirs[i].path != NULL) {
+      close(cache->dirs[i].fd);
+      free(cache->dirs[i].path);
+      cache->dirs[i].path = NULL;
+    }
+  }
+}
+
+/**
+ * Finds the directory holding path, opening it if it is not in the cache,
+ * and the name of path within it
+ * @return: a file descriptor of the directory, not to be closed,
+ *          or -1 on error
+ */
+static inline int dir_cache_lookup(dir_cache *cache, const char *path,
+                                   const char **name) {
+  const char *slash = strrchr(path, '/');
+  char *directory;
+  size_t length;
+  cached_dir *entry;
+  int fd;
+  int i;
+
+  if (slash == NULL) {
+    *name = path;
+    return AT_FDCWD; // relative to the current directory
+  }
+
+  *name = slash + 1;
+  length = (slash == path) ? 1 : (size_t) (slash - path); // "/" stays "/"
+
+  for (i = 0; i < DIR_CACHE_SIZE; i++) {
+    entry = &cache->dirs[i];
+    if (entry->path != NULL && strlen(entry->path) == length &&
+        strncmp(entry->path, path, length) == 0) {
+      cache->hits++;
+      return entry->fd;
+    }
+  }
+
+  cache->misses++;
+  if ((directory = strndup(path, length)) == NULL) {
+    return -1;
+  }
+
+  if ((fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    free(directory);
+    return -1;
+  }
+
+  entry = &cache->dirs[cache->next_victim];
+  cache->next_victim = (cache->next_victim + 1) % DIR_CACHE_SIZE;
+  if (entry->path != NULL) {
+    close(entry->fd);
+    free(entry->path);
+  }
+  entry->path = directory;
+  entry->fd = fd;
+
+  return fd;
+}
@@ -0,0 +1,103 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// keeping a copy out of the page cache, used by cp_copy_v4
+//
+// Every byte a normal copy moves goes through the page cache, and a big
+// copy pushes out the pages other programs were using. Two ways around it:
+//   CACHE_DROP   - copy as usual, but once a range is done write it back
+//                  and drop it, from both files, with posix_fadvise().
+//                  Works with every method and every file system.
+//   CACHE_DIRECT - open both files with O_DIRECT, so reads and writes go
+//                  straight between the device and our buffer. The buffer
+//                  must be aligned, and every offset and size a multiple of
+//                  the block size; the engine handles the partial block at
+//                  the end of the file. Only the read/write loop is used.
+// File systems that do not support O_DIRECT get CACHE_DROP instead.
+// Requires copy_engine.h.
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef enum _cache_mode {
+  CACHE_KEEP, // the default: leave the pages in the cache
+  CACHE_DROP, // --drop-cache
+  CACHE_DIRECT // --direct
+} cache_mode;
+
+/**
+ * Sets up the engine for a cache mode. For O_DIRECT, its buffer is replaced
+ * by a page-aligned one from posix_memalign(), a whole number of pages
+ * long; each engine has its own, so the threads of a copy share a pool
+ * of aligned buffers.
+ * @return: 0 on success
+ *          -1 if the buffer could not be allocated
+ */
+static inline int engine_set_cache(copy_engine *engine, cache_mode mode) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t size;
+  void *buffer;
+
+  engine->drop_cache = (mode == CACHE_DROP);
+  engine->direct_align = 0;
+
+  if (mode != CACHE_DIRECT) {
+    return 0;
+  }
+
+  size = (engine->buffer_size + page_size - 1) / page_size * page_size;
+  if ((errno = posix_memalign(&buffer, page_size, size)) != 0) {
+    return -1;
+  }
+
+  free(engine->buffer);
+  engine->buffer = buffer;
+  engine->buffer_size = size;
+  engine->direct_align = page_size;
+
+  return 0;
+}
+
+/**
+ * Turns on O_DIRECT for an open source and target, for an engine set up
+ * with CACHE_DIRECT. When the files do not allow it (not regular files, or
+ * a file system without O_DIRECT) the engine drops the cache instead, for
+ * these files only.
+ * @return: 0 if O_DIRECT is used
+ *          -1 if the cache is dropped instead
+ */
+static inline int engine_open_direct(copy_engine *engine, int in_fd,
+                                     int out_fd, struct stat *source_stat) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  int in_flags;
+  int out_flags;
+
+  engine->direct_align = 0;
+  engine->drop_cache = 1;
+
+  if (!S_ISREG(source_stat->st_mode)) {
+    return -1;
+  }
+
+  engine->syscalls += 2;
+  if ((in_flags = fcntl(in_fd, F_GETFL)) == -1 ||
+      (out_flags = fcntl(out_fd, F_GETFL)) == -1) {
+    return -1;
+  }
+
+  engine->syscalls++;
+  if (fcntl(in_fd, F_SETFL, in_flags | O_DIRECT) == -1) {
+    return -1;
+  }
+
+  engine->syscalls++;
+  if (fcntl(out_fd, F_SETFL, out_flags | O_DIRECT) == -1) {
+    engine->syscalls++;
+    fcntl(in_fd, F_SETFL, in_flags);
+    return -1;
+  }
+
+  engine->direct_align = page_size;
+  engine->drop_cache = 0;
+
+  return 0;
+}
@@ -0,0 +1,200 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// parallel copy of a single file, used by cp_copy_v4
+//
+// One stream of copy calls cannot keep a RAID of fast disks, or a network
+// file system, busy. The file is cut into chunks and a pool of threads
+// copies them at the same time; each thread asks for the next chunk not
+// yet taken, so a slow chunk does not hold up the others.
+// Every copy method of the engine passes explicit offsets, so the threads
+// can share the two file descriptors, except sendfile() which writes at the
+// file position of the target and is therefore not used here.
+// Requires copy_engine.h, sparse.h and page_cache.h.
+#include <pthread.h>
+
+#define DEFAULT_CHUNK_SIZE (64 * 1024 * 1024) // bytes handed to a thread
+
+typedef struct _copy_job {
+  int in_fd;
+  int out_fd;
+  off_t length; // size of the source
+  off_t chunk_size;
+  off_t next_offset; // start of the first chunk not yet taken
+  int error; // errno of the first failure, 0 if none
+  pthread_mutex_t lock; // protects next_offset and error
+} copy_job;
+
+typedef struct _copy_worker {
+  pthread_t thread;
+  copy_job *job;
+  copy_engine engine; // each thread has its own buffer, pipe and counters
+} copy_worker;
+
+/**
+ * Takes the next chunk of the job
+ * @return: the offset of the chunk or -1 if there is nothing left to do
+ */
+static inline off_t next_chunk(copy_job *job) {
+  off_t offset = -1;
+
+  pthread_mutex_lock(&job->lock);
+  if (job->error == 0 && job->next_offset < job->length) {
+    offset = job->next_offset;
+    job->next_offset += job->chunk_size;
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  return offset;
+}
+
+/**
+ * Thread routine: copies chunks until there are none left
+ * or one of the threads fails
+ */
+static void *copy_chunks(void *data) {
+  copy_worker *worker = (copy_worker*) data;
+  copy_job *job = worker->job;
+  off_t offset;
+  off_t length;
+
+  while ((offset = next_chunk(job)) != -1) {
+    length = (job->length - offset > job->chunk_size) ? job->chunk_size
+                                                      : job->length - offset;
+
+    if (sparse_copy_range(&worker->engine, job->in_fd, job->out_fd, offset,
+                          length) == -1) {
+      pthread_mutex_lock(&job->lock);
+      if (job->error == 0) {
+        job->error = errno;
+      }
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Adds the counters of a worker's engine to those of the main engine
+ */
+static inline void engine_add(copy_engine *total, copy_engine *part) {
+  int i;
+
+  total->syscalls += part->syscalls;
+  total->bytes_cloned += part->bytes_cloned;
+  total->bytes_skipped += part->bytes_skipped;
+  total->reader_blocked += part->reader_blocked;
+  total->writer_blocked += part->writer_blocked;
+
+  for (i = 0; i < NUM_METHODS; i++) {
+    total->bytes_by_method[i] += part->bytes_by_method[i];
+  }
+}
+
+/**
+ * Reserves the blocks of the whole target at once, so the threads writing
+ * their chunks in any order do not fragment it. A sparse source is not
+ * preallocated: that would fill in the holes the copy keeps.
+ */
+static inline void preallocate(copy_engine *engine, int out_fd,
+                               struct stat *source_stat) {
+  int sparse_source =
+      (off_t) source_stat->st_blocks * 512 < source_stat->st_size;
+
+  if (engine->sparse == SPARSE_ALWAYS ||
+      (engine->sparse == SPARSE_AUTO && sparse_source)) {
+    return;
+  }
+
+  // not every file system can do it, and the copy works without
+  engine->syscalls++;
+  fallocate(out_fd, 0, 0, source_stat->st_size);
+}
+
+/**
+ * Copies the length bytes of in_fd to out_fd with num_threads threads,
+ * each set up like the given engine. The target must already have its
+ * final size.
+ * @return: length on success
+ *          -1 on error, with errno set by the first thread that failed
+ */
+static inline off_t parallel_copy(copy_engine *engine, int in_fd, int out_fd,
+                                  off_t length, int num_threads,
+                                  off_t chunk_size) {
+  copy_job job;
+  copy_worker *workers;
+  long page_size = sysconf(_SC_PAGESIZE);
+  int started;
+  int i;
+
+  // chunks start on page boundaries, which mmap needs
+  chunk_size = (chunk_size + page_size - 1) / page_size * page_size;
+
+  job.in_fd = in_fd;
+  job.out_fd = out_fd;
+  job.length = length;
+  job.chunk_size = chunk_size;
+  job.next_offset = 0;
+  job.error = 0;
+  pthread_mutex_init(&job.lock, NULL);
+
+  if ((workers = calloc(num_threads, sizeof(copy_worker))) == NULL) {
+    return -1;
+  }
+
+  for (started = 0; started < num_threads; started++) {
+    copy_worker *worker = &workers[started];
+
+    worker->job = &job;
+    if (engine_init(&worker->engine, engine->method,
+                    engine->buffer_size) == -1) {
+      errno = ENOMEM;
+      break;
+    }
+
+    if (engine->direct_align > 0 &&
+        engine_set_cache(&worker->engine, CACHE_DIRECT) == -1) {
+      engine_free(&worker->engine);
+      errno = ENOMEM;
+      break;
+    }
+
+    worker->engine.drop_cache = engine->drop_cache;
+    worker->engine.stats = engine->stats;
+    worker->engine.window_size = engine->window_size;
+    worker->engine.queue_depth = engine->queue_depth;
+    worker->engine.sparse = engine->sparse;
+    worker->engine.skip_zeros = engine->skip_zeros;
+    worker->engine.punch_holes = engine->punch_holes;
+    worker->engine.no_sendfile = 1;
+
+    if ((errno = pthread_create(&worker->thread, NULL, copy_chunks,
+                                worker)) != 0) {
+      engine_free(&worker->engine);
+      break;
+    }
+  }
+
+  // tell the threads already running to stop, if not all could start
+  if (started < num_threads) {
+    pthread_mutex_lock(&job.lock);
+    job.error = errno;
+    pthread_mutex_unlock(&job.lock);
+  }
+
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+    engine_add(engine, &workers[i].engine);
+    engine_free(&workers[i].engine);
+  }
+
+  free(workers);
+  pthread_mutex_destroy(&job.lock);
+
+  if (job.error != 0) {
+    errno = job.error;
+    return -1;
+  }
+
+  return length;
+}
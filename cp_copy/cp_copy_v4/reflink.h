@@ -0,0 +1,129 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// reflink (copy-on-write clone) support used by cp_copy_v4
+//
+// On file systems such as btrfs and XFS two files can share the same data
+// blocks; a block is only really copied when one of the files writes to it.
+// The FICLONE ioctl makes the target share every extent of the source and
+// FICLONERANGE does the same for one range, so a copy becomes a metadata
+// operation. Ranges that cannot be shared are copied by the copy engine.
+// Requires copy_engine.h and sparse.h.
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#define CLONE_CHUNK (64 * 1024 * 1024) // bytes cloned per FICLONERANGE
+
+typedef enum _reflink_mode {
+  REFLINK_NEVER, // always copy the data
+  REFLINK_AUTO, // clone what can be cloned, copy the rest
+  REFLINK_ALWAYS // fail if any part of the file cannot be cloned
+} reflink_mode;
+
+/**
+ * Converts the argument of --reflink to a reflink_mode
+ * @return: the mode or -1 if the name is unknown
+ */
+static inline int reflink_from_name(const char *name) {
+  if (name == NULL || strcmp(name, "always") == 0) {
+    return REFLINK_ALWAYS; // plain --reflink means always, like GNU cp
+  } else if (strcmp(name, "auto") == 0) {
+    return REFLINK_AUTO;
+  } else if (strcmp(name, "never") == 0) {
+    return REFLINK_NEVER;
+  }
+
+  return -1;
+}
+
+/**
+ * An error that means the two files can never share blocks,
+ * so there is no point trying the other ranges
+ */
+static inline int clone_unsupported(int error) {
+  return error == EXDEV || error == EOPNOTSUPP || error == ENOTSUP ||
+         error == ENOSYS || error == ENOTTY || error == EBADF;
+}
+
+/**
+ * Makes out_fd share every extent of in_fd with FICLONE
+ * @return: 0 on success
+ *          -1 if the file system refused
+ */
+static inline int reflink_whole_file(copy_engine *engine, int in_fd,
+                                     int out_fd, off_t length) {
+  engine->syscalls++;
+  if (ioctl(out_fd, FICLONE, in_fd) == -1) {
+    return -1;
+  }
+
+  engine->bytes_cloned += length;
+  stats_add_bytes(engine->stats, length);
+  return 0;
+}
+
+/**
+ * Clones length bytes of in_fd into out_fd. The whole file is tried first
+ * with FICLONE. If that is refused, the file is walked in CLONE_CHUNK
+ * ranges with FICLONERANGE, and with REFLINK_AUTO any range that
+ * cannot be shared is copied by the engine instead.
+ * Offsets of a clone must be multiples of the file system block size,
+ * which CLONE_CHUNK is; the last range may end anywhere since it ends
+ * at the end of the source.
+ * @return: number of bytes present in the target
+ *          -1 on error, or if REFLINK_ALWAYS could not clone everything
+ */
+static inline off_t reflink_copy(copy_engine *engine, reflink_mode mode,
+                                 int in_fd, int out_fd, off_t length) {
+  struct file_clone_range range;
+  off_t offset = 0;
+  off_t n;
+  int can_clone = 1;
+
+  if (mode == REFLINK_NEVER || length < 0) {
+    return sparse_copy_range(engine, in_fd, out_fd, 0, length);
+  }
+
+  if (reflink_whole_file(engine, in_fd, out_fd, length) == 0) {
+    return length;
+  } else if (clone_unsupported(errno)) {
+    if (mode == REFLINK_ALWAYS) {
+      return -1;
+    }
+    can_clone = 0;
+  }
+
+  while (offset < length) {
+    off_t chunk = (length - offset > CLONE_CHUNK) ? CLONE_CHUNK
+                                                  : length - offset;
+
+    if (can_clone) {
+      range.src_fd = in_fd;
+      range.src_offset = offset;
+      range.src_length = chunk;
+      range.dest_offset = offset;
+
+      engine->syscalls++;
+      if (ioctl(out_fd, FICLONERANGE, &range) == 0) {
+        engine->bytes_cloned += chunk;
+        stats_add_bytes(engine->stats, chunk);
+        offset += chunk;
+        continue;
+      } else if (mode == REFLINK_ALWAYS) {
+        return -1;
+      } else if (clone_unsupported(errno)) {
+        can_clone = 0; // stop asking, copy everything that is left
+      }
+    }
+
+    // this range could not be shared, so copy its data
+    if ((n = sparse_copy_range(engine, in_fd, out_fd, offset,
+                               can_clone ? chunk : length - offset)) == -1) {
+      return -1;
+    } else if (n == 0) {
+      break; // source shrank while we were copying it
+    }
+
+    offset += n;
+  }
+
+  return offset;
+}
@@ -0,0 +1,362 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// resumable copy, used by cp_copy_v4 --resume
+//
+// creat() truncates the target, so a copy that is interrupted starts over
+// from the first byte. A resumable copy keeps, next to the target, a small
+// journal of how far it got. Every RESUME_INTERVAL bytes the target is
+// flushed with fdatasync(), its last block is read back and compared with
+// the source, and only then is the new offset written to the journal: the
+// journal never claims data that is not on the device.
+// The journal also records which source it is about (size, modification
+// time and inode) and the crc32c of the block just before the offset.
+// On restart the copy resumes at that offset only if the source is the
+// same and the target still holds that block; otherwise it starts over.
+// The journal is replaced with rename(), which is atomic, and carries a
+// crc32c of its own, so a crash while writing it cannot leave a journal
+// that looks valid but is not.
+// Requires copy_engine.h and sparse.h.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RESUME_INTERVAL (256 * 1024 * 1024) // bytes copied between journals
+#define RESUME_BLOCK (64 * 1024) // bytes checked before the offset
+#define JOURNAL_SUFFIX ".cp_journal" // appended to the target name
+#define JOURNAL_MAX 256 // longest journal line
+
+typedef struct _journal {
+  long long size; // of the source
+  long long mtime_sec; // of the source
+  long mtime_nsec;
+  unsigned long long inode; // of the source
+  off_t offset; // everything before is safely in the target
+  long block_length; // the block that ends at offset
+  uint32_t block_crc; // and its crc32c
+} journal;
+
+/**
+ * The name of the journal of a target
+ * @return: a string to be freed, or NULL if out of memory
+ */
+static inline char *journal_path(const char *target) {
+  char *path;
+
+  if ((path = malloc(strlen(target) + strlen(JOURNAL_SUFFIX) + 1)) != NULL) {
+    sprintf(path, "%s%s", target, JOURNAL_SUFFIX);
+  }
+
+  return path;
+}
+
+/**
+ * Fills in the part of a journal that identifies the source
+ */
+static inline void journal_init(journal *entry, struct stat *source_stat) {
+  memset(entry, 0, sizeof(journal));
+  entry->size = source_stat->st_size;
+  entry->mtime_sec = source_stat->st_mtim.tv_sec;
+  entry->mtime_nsec = source_stat->st_mtim.tv_nsec;
+  entry->inode = source_stat->st_ino;
+}
+
+/**
+ * Formats a journal as one line, followed by the crc32c of that line
+ * @return: length of the text
+ */
+static inline int journal_format(journal *entry, char *text) {
+  int length;
+
+  length = snprintf(text, JOURNAL_MAX, "cp_copy_v4 %lld %lld %ld %llu %lld "
+                    "%ld %08x", entry->size, entry->mtime_sec,
+                    entry->mtime_nsec, entry->inode,
+                    (long long) entry->offset, entry->block_length,
+                    entry->block_crc);
+  length += snprintf(text + length, JOURNAL_MAX - length, " %08x\n",
+                     crc32c_of(text, length));
+
+  return length;
+}
+
+/**
+ * Reads the journal at path
+ * @return: 0 on success
+ *          -1 if there is none, or it is not a valid journal
+ */
+static inline int journal_read(const char *path, journal *entry) {
+  char text[JOURNAL_MAX];
+  char expected[JOURNAL_MAX];
+  long long offset;
+  unsigned block_crc;
+  ssize_t length;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+    return -1;
+  }
+  length = read(fd, text, sizeof(text) - 1);
+  close(fd);
+
+  if (length <= 0) {
+    return -1;
+  }
+  text[length] = '\0';
+
+  if (sscanf(text, "cp_copy_v4 %lld %lld %ld %llu %lld %ld %x",
+             &entry->size, &entry->mtime_sec, &entry->mtime_nsec,
+             &entry->inode, &offset, &entry->block_length,
+             &block_crc) != 7) {
+    return -1;
+  }
+  entry->offset = offset;
+  entry->block_crc = block_crc;
+
+  // formatting it again must give the same line, crc included
+  if (journal_format(entry, expected) != length ||
+      memcmp(text, expected, length) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Replaces the journal at path: the new one is written and flushed under
+ * a temporary name, then renamed over the old one
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int journal_write(copy_engine *engine, const char *path,
+                                journal *entry) {
+  char text[JOURNAL_MAX];
+  char *temporary;
+  int length;
+  int fd;
+  int result = -1;
+
+  if ((temporary = malloc(strlen(path) + 5)) == NULL) {
+    return -1;
+  }
+  sprintf(temporary, "%s.new", path);
+  length = journal_format(entry, text);
+
+  engine->syscalls += 4;
+  if ((fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644)) != -1) {
+    if (write(fd, text, length) == length && fsync(fd) == 0 &&
+        close(fd) == 0) {
+      fd = -1;
+      result = rename(temporary, path);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  free(temporary);
+  return result;
+}
+
+/**
+ * crc32c of [offset, offset + length) of a file, read into buffer, which
+ * must hold RESUME_BLOCK bytes
+ * @return: 0 on success
+ *          -1 on error, or if the file ends before the range does
+ */
+static inline int block_crc(copy_engine *engine, int fd, off_t offset,
+                            long length, char *buffer, uint32_t *crc) {
+  long done = 0;
+  ssize_t n_chars;
+
+  while (done < length) {
+    engine->syscalls++;
+    n_chars = pread(fd, buffer + done, length - done, offset + done);
+    if (n_chars == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    } else if (n_chars == 0) {
+      errno = EIO;
+      return -1;
+    }
+    done += n_chars;
+  }
+
+  *crc = crc32c_of(buffer, length);
+  return 0;
+}
+
+/**
+ * Finds where an interrupted copy can carry on from, checking that the
+ * journal is about this source and that the target still holds the
+ * block it recorded
+ * @return: the offset to resume at, 0 to start over
+ */
+static inline off_t resume_point(copy_engine *engine, int out_fd,
+                                 const char *path, struct stat *source_stat,
+                                 char *buffer) {
+  journal expected;
+  journal found;
+  struct stat target_stat;
+  uint32_t crc;
+
+  journal_init(&expected, source_stat);
+
+  if (journal_read(path, &found) == -1 || found.size != expected.size ||
+      found.mtime_sec != expected.mtime_sec ||
+      found.mtime_nsec != expected.mtime_nsec ||
+      found.inode != expected.inode || found.offset <= 0 ||
+      found.offset > found.size || found.block_length <= 0 ||
+      found.block_length > RESUME_BLOCK ||
+      found.block_length > found.offset) {
+    return 0;
+  }
+
+  engine->syscalls++;
+  if (fstat(out_fd, &target_stat) == -1 ||
+      target_stat.st_size < found.offset ||
+      block_crc(engine, out_fd, found.offset - found.block_length,
+                found.block_length, buffer, &crc) == -1 ||
+      crc != found.block_crc) {
+    return 0;
+  }
+
+  return found.offset;
+}
+
+/**
+ * Feeds [0, length) of the source, which an earlier run copied, to the
+ * checksum of the engine
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int feed_copied(copy_engine *engine, int in_fd, off_t length) {
+  off_t done = 0;
+  ssize_t n_chars;
+
+  while (done < length) {
+    engine->syscalls++;
+    n_chars = pread(in_fd, engine->buffer, engine->buffer_size, done);
+    if (n_chars == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    } else if (n_chars == 0) {
+      errno = EIO; // the source is shorter than the journal said
+      return -1;
+    }
+
+    if (done + n_chars > length) {
+      n_chars = length - done;
+    }
+    checksum_update(engine->sum, engine->buffer, n_chars);
+    done += n_chars;
+  }
+
+  return 0;
+}
+
+/**
+ * Records that everything before entry->offset is in the target: flushes
+ * the target, checks its last block against the source and writes the
+ * journal
+ * @return: 0 on success
+ *          -1 on error, with errno EIO if the block does not match
+ */
+static inline int journal_checkpoint(copy_engine *engine, int in_fd,
+                                     int out_fd, const char *path,
+                                     journal *entry, char *buffer) {
+  off_t block_offset = entry->offset - RESUME_BLOCK;
+  uint32_t source_crc;
+
+  entry->block_length = RESUME_BLOCK;
+
+  engine->syscalls++;
+  if (fdatasync(out_fd) == -1 ||
+      block_crc(engine, in_fd, block_offset, RESUME_BLOCK, buffer,
+                &source_crc) == -1 ||
+      block_crc(engine, out_fd, block_offset, RESUME_BLOCK, buffer,
+                &entry->block_crc) == -1) {
+    return -1;
+  }
+
+  if (source_crc != entry->block_crc) {
+    errno = EIO;
+    return -1;
+  }
+
+  return journal_write(engine, path, entry);
+}
+
+/**
+ * Copies a regular file of the given length to a target that may hold
+ * part of an earlier, interrupted copy, recorded in the journal at path.
+ * The journal is removed once the copy is complete. If the engine
+ * computes a checksum, the part that was already copied is read from
+ * the source and fed to it.
+ * @return: number of bytes of the file, resumed_from tells how many of
+ *          them were already there
+ *          -1 on error
+ */
+static inline off_t resume_copy(copy_engine *engine, int in_fd, int out_fd,
+                                off_t length, struct stat *source_stat,
+                                const char *path, off_t *resumed_from) {
+  journal entry;
+  char *buffer;
+  off_t offset;
+  off_t step;
+  off_t n = 0;
+  int result = 0;
+
+  if ((errno = posix_memalign((void**) &buffer, sysconf(_SC_PAGESIZE),
+                              RESUME_BLOCK)) != 0) {
+    return -1;
+  }
+
+  offset = resume_point(engine, out_fd, path, source_stat, buffer);
+  *resumed_from = offset;
+
+  // starting over: the old contents must not show through the holes;
+  // resuming: they can beyond the offset, so holes are punched there
+  engine->syscalls += 2;
+  if ((offset == 0 && ftruncate(out_fd, 0) == -1) ||
+      ftruncate(out_fd, length) == -1) {
+    result = -1;
+  } else if (offset > 0) {
+    engine_set_sparse(engine, engine->sparse, 1);
+  }
+
+  // the checksum covers the whole file, so read what is not copied again
+  if (result == 0 && engine->sum != NULL && offset > 0) {
+    result = feed_copied(engine, in_fd, offset);
+  }
+
+  journal_init(&entry, source_stat);
+
+  while (result == 0 && offset < length) {
+    step = (length - offset > RESUME_INTERVAL) ? RESUME_INTERVAL
+                                               : length - offset;
+    if ((n = sparse_copy_range(engine, in_fd, out_fd, offset, step)) == -1) {
+      result = -1;
+      break;
+    }
+    offset += n;
+
+    // the end needs no journal, it is removed below
+    if (n == step && offset < length) {
+      entry.offset = offset;
+      result = journal_checkpoint(engine, in_fd, out_fd, path, &entry,
+                                  buffer);
+    } else {
+      break;
+    }
+  }
+
+  free(buffer);
+
+  engine->syscalls++;
+  if (result == -1 || (unlink(path) == -1 && errno != ENOENT)) {
+    return -1;
+  }
+
+  return offset;
+}
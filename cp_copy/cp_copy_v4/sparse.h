@@ -0,0 +1,120 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// sparse file support used by cp_copy_v4
+//
+// A sparse file has holes: ranges that were never written and that take
+// no space on disk but read as zeros. Copying such a file byte by byte,
+// as cp_copy_v3 does, reads every zero and allocates every hole in the
+// target. lseek() with SEEK_DATA and SEEK_HOLE finds where the data
+// really is, so only those extents are read and written. With
+// SPARSE_ALWAYS, blocks of zeros found inside the data are left out of
+// the target as well, so they become holes too.
+// Requires copy_engine.h.
+
+typedef enum _sparse_mode {
+  SPARSE_NEVER, // copy every byte, holes included
+  SPARSE_AUTO, // keep the holes of the source
+  SPARSE_ALWAYS // keep the holes and turn blocks of zeros into holes
+} sparse_mode;
+
+/**
+ * Converts the argument of --sparse to a sparse_mode
+ * @return: the mode or -1 if the name is unknown
+ */
+static inline int sparse_from_name(const char *name) {
+  if (strcmp(name, "auto") == 0) {
+    return SPARSE_AUTO;
+  } else if (strcmp(name, "always") == 0) {
+    return SPARSE_ALWAYS;
+  } else if (strcmp(name, "never") == 0) {
+    return SPARSE_NEVER;
+  }
+
+  return -1;
+}
+
+/**
+ * Sets up the engine for a sparse mode. target_has_data tells whether the
+ * target may hold old data that a skipped range must not show through,
+ * in which case holes are punched instead of just skipped.
+ */
+static inline void engine_set_sparse(copy_engine *engine, sparse_mode mode,
+                                     int target_has_data) {
+  engine->sparse = mode;
+  engine->skip_zeros = (mode == SPARSE_ALWAYS);
+  engine->punch_holes = (mode != SPARSE_NEVER) && target_has_data;
+}
+
+/**
+ * Copies [offset, offset + length) of in_fd to out_fd, visiting only the
+ * data extents of the source. The target must already have its final
+ * size (see ftruncate()), so that the holes at the end exist too.
+ * File systems without SEEK_DATA support report the whole file as data,
+ * and some report EINVAL; both simply give a plain copy.
+ * @return: number of bytes the range covers, smaller than length only
+ *          at end of file
+ *          -1 on error
+ */
+static inline off_t sparse_copy_range(copy_engine *engine, int in_fd,
+                                      int out_fd, off_t offset,
+                                      off_t length) {
+  off_t end = offset + length;
+  off_t data;
+  off_t hole;
+  off_t n;
+
+  if (engine->sparse == SPARSE_NEVER || length < 0) {
+    return engine_copy_range(engine, in_fd, out_fd, offset, length);
+  }
+
+  while (offset < end) {
+    engine->syscalls++;
+    if ((data = lseek(in_fd, offset, SEEK_DATA)) == -1) {
+      if (errno == ENXIO) {
+        data = end; // nothing but a hole up to the end of the file
+      } else if (errno == EINVAL || errno == EOPNOTSUPP) {
+        return engine_copy_range(engine, in_fd, out_fd, offset,
+                                 end - offset);
+      } else {
+        return -1;
+      }
+    }
+
+    if (data > end) {
+      data = end;
+    }
+
+    // [offset, data) is a hole in the source
+    if (data > offset) {
+      engine->bytes_skipped += data - offset;
+      if (engine->punch_holes &&
+          punch_hole(engine, out_fd, offset, data - offset) == -1) {
+        return -1;
+      }
+      offset = data;
+    }
+
+    if (offset == end) {
+      break;
+    }
+
+    engine->syscalls++;
+    if ((hole = lseek(in_fd, data, SEEK_HOLE)) == -1) {
+      return -1;
+    } else if (hole > end) {
+      hole = end;
+    }
+
+    // [data, hole) holds data
+    if ((n = engine_copy_range(engine, in_fd, out_fd, data,
+                               hole - data)) == -1) {
+      return -1;
+    }
+
+    offset = data + n;
+    if (n < hole - data) {
+      break; // the source shrank
+    }
+  }
+
+  return length - (end - offset);
+}
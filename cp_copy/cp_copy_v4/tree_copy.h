@@ -0,0 +1,617 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// recursive copy of a directory tree, used by cp_copy_v4 -r
+//
+// When a tree holds many small files, the time goes into opening, creating
+// and closing them rather than into copying data, and those calls mostly
+// wait on the file system. So one thread walks the source tree and creates
+// the directories, and a fixed pool of worker threads copies the files it
+// finds, many at a time.
+//
+// Nothing is looked up by full path name: every directory is opened
+// relative to its parent with openat() and every entry is examined with
+// fstatat() relative to its directory, so the kernel never walks the path
+// from the top again. A directory's file descriptors stay open until the
+// last of its files is copied. Past MAX_PENDING_DIRS directories kept open
+// only for their queued files, the walk waits for the workers before it
+// opens another one, so a tree of many small directories cannot run out
+// of file descriptors.
+//
+// A directory is created before anything is put in it. Its real mode and
+// the times of every entry are set at the very end, in one pass, because
+// creating entries changes the modification time of their directory and
+// a read-only directory could not be filled.
+// Requires copy_engine.h and parallel_copy.h.
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+
+#define DEFAULT_TREE_WORKERS 8 // threads copying files with -r
+#define QUEUE_SIZE 1024 // files waiting for a worker
+#define MAX_PENDING_DIRS 128 // directories open for queued files only
+
+// a directory of the source and its copy, shared by the files in it
+typedef struct _dir_node {
+  int source_fd;
+  int target_fd;
+  int refs; // files not yet copied, plus one while the walker uses it
+} dir_node;
+
+// a file waiting to be copied
+typedef struct _file_task {
+  dir_node *dir;
+  char *path; // relative to the roots, ends with the name in dir
+  struct stat stat;
+} file_task;
+
+// mode and times of an entry, set in the final pass
+typedef struct _meta_entry {
+  char *path; // relative to the target root
+  mode_t mode;
+  struct timespec times[2]; // access and modification times
+} meta_entry;
+
+typedef struct _tree_copy {
+  int (*setup)(copy_engine *engine, void *arg); // prepares a worker engine
+  int (*copy)(copy_engine *engine, const char *name, int in_fd, int out_fd,
+              struct stat *source_stat, void *arg); // copies one file
+  void *arg; // passed to setup and copy
+  int target_flags; // open() flags of a target file
+
+  file_task queue[QUEUE_SIZE]; // circular buffer of files to copy
+  int front;
+  int count;
+  int walk_done; // no more files will be queued
+  int open_dirs; // dir_nodes open
+  int walk_depth; // of them, the ones the walk is in
+  pthread_mutex_t lock; // protects the queue, refs, open_dirs and errors
+  pthread_cond_t space_available;
+  pthread_cond_t data_available;
+  pthread_cond_t dir_closed;
+
+  meta_entry *meta; // every entry copied, in the order it was created
+  size_t meta_count;
+  size_t meta_size;
+
+  copy_engine total; // counters of all workers
+  int errors;
+} tree_copy;
+
+/**
+ * Drops a reference to a directory, closing it after the last one.
+ * Must be called with the lock held.
+ */
+static inline void dir_release(tree_copy *tree, dir_node *dir) {
+  if (--dir->refs == 0) {
+    close(dir->source_fd);
+    close(dir->target_fd);
+    free(dir);
+    tree->open_dirs--;
+    pthread_cond_signal(&tree->dir_closed);
+  }
+}
+
+/**
+ * Reports an error on one entry; the copy goes on with the others
+ */
+static inline void tree_error(tree_copy *tree, const char *what,
+                              const char *name) {
+  int saved_errno = errno;
+
+  pthread_mutex_lock(&tree->lock);
+  fprintf(stderr, "Error: %s %s: %s\n", what, name, strerror(saved_errno));
+  tree->errors++;
+  pthread_mutex_unlock(&tree->lock);
+}
+
+/**
+ * Remembers the mode and times to give an entry at the end
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int remember_meta(tree_copy *tree, const char *path,
+                                struct stat *stat_buffer) {
+  meta_entry *entry;
+
+  if (tree->meta_count == tree->meta_size) {
+    size_t size = tree->meta_size ? 2 * tree->meta_size : 256;
+    meta_entry *meta = realloc(tree->meta, size * sizeof(meta_entry));
+
+    if (meta == NULL) {
+      return -1;
+    }
+    tree->meta = meta;
+    tree->meta_size = size;
+  }
+
+  entry = &tree->meta[tree->meta_count];
+  if ((entry->path = strdup(path)) == NULL) {
+    return -1;
+  }
+  entry->mode = stat_buffer->st_mode;
+  entry->times[0] = stat_buffer->st_atim;
+  entry->times[1] = stat_buffer->st_mtim;
+  tree->meta_count++;
+
+  return 0;
+}
+
+/**
+ * remember_meta(), reporting when it fails; the entry is still copied,
+ * without its mode and times
+ */
+static inline void keep_meta(tree_copy *tree, const char *path,
+                             struct stat *stat_buffer) {
+  if (remember_meta(tree, path, stat_buffer) == -1) {
+    errno = ENOMEM;
+    tree_error(tree, "Cannot keep mode and times of", path);
+  }
+}
+
+/**
+ * Hands a file to the workers, waiting while the queue is full
+ */
+static inline void queue_file(tree_copy *tree, dir_node *dir,
+                              const char *path, struct stat *stat_buffer) {
+  file_task *task;
+
+  pthread_mutex_lock(&tree->lock);
+  while (tree->count == QUEUE_SIZE) {
+    pthread_cond_wait(&tree->space_available, &tree->lock);
+  }
+
+  task = &tree->queue[(tree->front + tree->count) % QUEUE_SIZE];
+  task->dir = dir;
+  task->path = strdup(path);
+  task->stat = *stat_buffer;
+  dir->refs++;
+  tree->count++;
+
+  pthread_cond_signal(&tree->data_available);
+  pthread_mutex_unlock(&tree->lock);
+}
+
+/**
+ * Copies one file of the queue, relative to its directories
+ */
+static inline void copy_task(tree_copy *tree, copy_engine *engine,
+                             file_task *task) {
+  char *name;
+  int in_fd;
+  int out_fd;
+
+  if (task->path == NULL) {
+    errno = ENOMEM;
+    tree_error(tree, "Cannot queue", "file");
+    return;
+  }
+
+  name = strrchr(task->path, '/');
+  name = (name == NULL) ? task->path : name + 1;
+
+  if ((in_fd = openat(task->dir->source_fd, name,
+                      O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) == -1) {
+    tree_error(tree, "Cannot open", task->path);
+    return;
+  }
+
+  // created owner-only; the real mode is set in the final pass
+  if ((out_fd = openat(task->dir->target_fd, name, tree->target_flags,
+                       S_IRUSR | S_IWUSR)) == -1) {
+    tree_error(tree, "Cannot creat", task->path);
+    close(in_fd);
+    return;
+  }
+
+  if (tree->copy(engine, task->path, in_fd, out_fd, &task->stat,
+                 tree->arg) == -1) {
+    tree_error(tree, "Copy error to", task->path);
+  }
+
+  close(in_fd);
+  if (close(out_fd) == -1) {
+    tree_error(tree, "Error closing", task->path);
+  }
+}
+
+/**
+ * Thread routine of the workers: takes files off the queue and copies
+ * them, until the walk is over and the queue is empty
+ */
+static void *tree_worker(void *data) {
+  tree_copy *tree = (tree_copy*) data;
+  copy_engine engine;
+  file_task task;
+  int ready;
+
+  ready = (tree->setup(&engine, tree->arg) == 0);
+
+  while (1) {
+    pthread_mutex_lock(&tree->lock);
+    while (tree->count == 0 && !tree->walk_done) {
+      pthread_cond_wait(&tree->data_available, &tree->lock);
+    }
+
+    if (tree->count == 0) {
+      pthread_mutex_unlock(&tree->lock);
+      break; // walk over, nothing left
+    }
+
+    task = tree->queue[tree->front];
+    tree->front = (tree->front + 1) % QUEUE_SIZE;
+    tree->count--;
+    pthread_cond_signal(&tree->space_available);
+    pthread_mutex_unlock(&tree->lock);
+
+    if (ready) {
+      copy_task(tree, &engine, &task);
+    } else {
+      errno = ENOMEM;
+      tree_error(tree, "Cannot copy", task.path ? task.path : "file");
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    free(task.path);
+    dir_release(tree, task.dir);
+    pthread_mutex_unlock(&tree->lock);
+  }
+
+  if (ready) {
+    pthread_mutex_lock(&tree->lock);
+    engine_add(&tree->total, &engine);
+    pthread_mutex_unlock(&tree->lock);
+    engine_free(&engine);
+  }
+
+  return NULL;
+}
+
+/**
+ * Copies a symbolic link itself, not what it points to
+ */
+static inline void copy_symlink(tree_copy *tree, dir_node *dir,
+                                const char *name) {
+  char link[PATH_MAX];
+  ssize_t count;
+
+  if ((count = readlinkat(dir->source_fd, name, link,
+                          sizeof(link) - 1)) == -1) {
+    tree_error(tree, "Cannot read link", name);
+    return;
+  }
+  link[count] = '\0';
+
+  if (symlinkat(link, dir->target_fd, name) == -1) {
+    tree_error(tree, "Cannot create link", name);
+  }
+}
+
+/**
+ * Walks one directory of the source: creates its subdirectories and walks
+ * them, copies its links and queues its files.
+ * path is the directory relative to the roots, and has room for PATH_MAX.
+ */
+static void walk_dir(tree_copy *tree, dir_node *dir, char *path) {
+  DIR *dir_ptr;
+  struct dirent *dirent_pointer;
+  struct stat stat_buffer;
+  dir_node *child;
+  size_t path_length = strlen(path);
+  int fd;
+
+  // readdir() needs a DIR of its own, which closes its descriptor
+  if ((fd = dup(dir->source_fd)) == -1 ||
+      (dir_ptr = fdopendir(fd)) == NULL) {
+    tree_error(tree, "Cannot read", path);
+    if (fd != -1) close(fd);
+    return;
+  }
+
+  while ((dirent_pointer = readdir(dir_ptr)) != NULL) {
+    char *name = dirent_pointer->d_name;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue; // skip dot and dot-dot entries
+    }
+
+    if (path_length + strlen(name) + 2 > PATH_MAX) {
+      errno = ENAMETOOLONG;
+      tree_error(tree, "Cannot copy", name);
+      continue;
+    }
+    sprintf(path + path_length, "/%s", name);
+
+    if (fstatat(dir->source_fd, name, &stat_buffer,
+                AT_SYMLINK_NOFOLLOW) == -1) {
+      tree_error(tree, "Cannot stat", path);
+      continue;
+    }
+
+    if (S_ISDIR(stat_buffer.st_mode)) {
+      // the directory exists before any of its children is queued
+      if (mkdirat(dir->target_fd, name, S_IRWXU) == -1 && errno != EEXIST) {
+        tree_error(tree, "Cannot create directory", path);
+        continue;
+      }
+
+      // the directories the walk is in are not waited for: they are
+      // only closed once it is out of them
+      pthread_mutex_lock(&tree->lock);
+      while (tree->open_dirs - tree->walk_depth >= MAX_PENDING_DIRS) {
+        pthread_cond_wait(&tree->dir_closed, &tree->lock);
+      }
+      tree->open_dirs++;
+      tree->walk_depth++;
+      pthread_mutex_unlock(&tree->lock);
+
+      if ((child = calloc(1, sizeof(dir_node))) == NULL ||
+          (child->source_fd = openat(dir->source_fd, name,
+                                     O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+          == -1) {
+        tree_error(tree, "Cannot open", path);
+        free(child);
+        child = NULL;
+      } else if ((child->target_fd = openat(dir->target_fd, name,
+                                            O_RDONLY | O_DIRECTORY |
+                                            O_CLOEXEC)) == -1) {
+          tree_error(tree, "Cannot open", path);
+          close(child->source_fd);
+          free(child);
+          child = NULL;
+      }
+
+      if (child != NULL) {
+        child->refs = 1;
+        keep_meta(tree, path + 2, &stat_buffer); // skip the leading "./"
+        walk_dir(tree, child, path);
+      }
+
+      pthread_mutex_lock(&tree->lock);
+      tree->walk_depth--;
+      if (child != NULL) {
+        dir_release(tree, child);
+      } else {
+          tree->open_dirs--;
+      }
+      pthread_mutex_unlock(&tree->lock);
+    } else if (S_ISLNK(stat_buffer.st_mode)) {
+      copy_symlink(tree, dir, name);
+      keep_meta(tree, path + 2, &stat_buffer);
+    } else if (S_ISREG(stat_buffer.st_mode)) {
+      keep_meta(tree, path + 2, &stat_buffer);
+      queue_file(tree, dir, path + 2, &stat_buffer);
+    } else {
+      fprintf(stderr, "%s: not a regular file, skipped\n", path);
+    }
+
+    path[path_length] = '\0';
+  }
+
+  closedir(dir_ptr);
+}
+
+/**
+ * Gives every copied entry the mode and times of its source. The entries
+ * are done last to first, so a directory comes after everything in it.
+ * Links have no mode of their own, only times.
+ */
+static inline void apply_meta(tree_copy *tree, int target_root_fd) {
+  size_t i;
+  meta_entry *entry;
+
+  for (i = tree->meta_count; i-- > 0;) {
+    entry = &tree->meta[i];
+
+    if (!S_ISLNK(entry->mode) &&
+        fchmodat(target_root_fd, entry->path, entry->mode & 07777, 0) == -1) {
+      tree_error(tree, "Cannot set mode of", entry->path);
+    }
+
+    if (utimensat(target_root_fd, entry->path, entry->times,
+                  AT_SYMLINK_NOFOLLOW) == -1) {
+      tree_error(tree, "Cannot set times of", entry->path);
+    }
+
+    free(entry->path);
+  }
+
+  free(tree->meta);
+  tree->meta = NULL;
+  tree->meta_count = tree->meta_size = 0;
+}
+
+/**
+ * Tells whether the directory open on fd is the one open on root_fd or
+ * is below it, going up with ".." until the root of the file system
+ * @return: 1 if it is, 0 if not
+ *          -1 on error
+ */
+static inline int inside_dir(int root_fd, int fd) {
+  struct stat root_stat;
+  struct stat stat_buffer;
+  struct stat parent_stat;
+  int parent_fd;
+  int result = -1;
+
+  if (fstat(root_fd, &root_stat) == -1 || (fd = dup(fd)) == -1) {
+    return -1;
+  }
+
+  while (fstat(fd, &stat_buffer) == 0) {
+    if (stat_buffer.st_dev == root_stat.st_dev &&
+        stat_buffer.st_ino == root_stat.st_ino) {
+      result = 1;
+      break;
+    }
+
+    if ((parent_fd = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+        == -1 || fstat(parent_fd, &parent_stat) == -1) {
+      if (parent_fd != -1) close(parent_fd);
+      break;
+    }
+    close(fd);
+    fd = parent_fd;
+
+    // the root of the file system is its own parent
+    if (parent_stat.st_dev == stat_buffer.st_dev &&
+        parent_stat.st_ino == stat_buffer.st_ino) {
+      result = 0;
+      break;
+    }
+  }
+
+  close(fd);
+  return result;
+}
+
+/**
+ * Opens the directory that would hold path
+ * @return: the file descriptor, or -1 on error
+ */
+static inline int open_parent(const char *path) {
+  char parent[PATH_MAX];
+  char *slash;
+
+  if (strlen(path) >= sizeof(parent)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(parent, path);
+
+  // trailing slashes do not make another level
+  for (slash = parent + strlen(parent) - 1; slash > parent && *slash == '/';
+       slash--) {
+    *slash = '\0';
+  }
+
+  if ((slash = strrchr(parent, '/')) == NULL) {
+    strcpy(parent, ".");
+  } else {
+      slash[(slash == parent) ? 1 : 0] = '\0';
+  }
+
+  return open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * Copies the directory source to target, which is created if needed,
+ * with num_workers threads copying the files. setup prepares the engine
+ * of each worker and copy copies one file; both get arg.
+ * The counters of all the engines are added to total.
+ * A target inside the source is refused: the walk would copy the copy.
+ * @return: number of entries that could not be copied
+ *          -1 if the copy could not start at all; errno is EINVAL if the
+ *          target is inside the source
+ */
+static inline int copy_tree(const char *source, const char *target,
+                            int num_workers, int target_flags,
+                            int (*setup)(copy_engine*, void*),
+                            int (*copy)(copy_engine*, const char*, int, int,
+                                        struct stat*, void*),
+                            void *arg, copy_engine *total) {
+  tree_copy *tree;
+  dir_node *root;
+  pthread_t *workers;
+  struct stat stat_buffer;
+  char path[PATH_MAX] = ".";
+  int target_root_fd;
+  int parent_fd;
+  int inside;
+  int started;
+  int errors;
+  int i;
+
+  if ((tree = calloc(1, sizeof(tree_copy))) == NULL ||
+      (root = calloc(1, sizeof(dir_node))) == NULL ||
+      (workers = calloc(num_workers, sizeof(pthread_t))) == NULL) {
+    return -1;
+  }
+
+  tree->setup = setup;
+  tree->copy = copy;
+  tree->arg = arg;
+  tree->target_flags = target_flags;
+  pthread_mutex_init(&tree->lock, NULL);
+  pthread_cond_init(&tree->space_available, NULL);
+  pthread_cond_init(&tree->data_available, NULL);
+  pthread_cond_init(&tree->dir_closed, NULL);
+
+  if ((root->source_fd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+      == -1 || fstat(root->source_fd, &stat_buffer) == -1) {
+    return -1;
+  }
+
+  // before the target is made: its parent must not be in the source
+  if ((parent_fd = open_parent(target)) != -1) {
+    inside = inside_dir(root->source_fd, parent_fd);
+    close(parent_fd);
+    if (inside == 1) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  if (mkdir(target, S_IRWXU) == -1 && errno != EEXIST) {
+    return -1;
+  }
+
+  if ((root->target_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+      == -1) {
+    return -1;
+  }
+
+  // an existing target may be the source itself
+  if (inside_dir(root->source_fd, root->target_fd) == 1) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // the final pass needs the root after the walk has released it
+  if ((target_root_fd = dup(root->target_fd)) == -1) {
+    return -1;
+  }
+
+  root->refs = 1;
+  tree->open_dirs = 1;
+  tree->walk_depth = 1;
+  if (remember_meta(tree, ".", &stat_buffer) == -1) {
+    return -1;
+  }
+
+  for (started = 0; started < num_workers; started++) {
+    if (pthread_create(&workers[started], NULL, tree_worker, tree) != 0) {
+      break;
+    }
+  }
+
+  if (started == 0) {
+    return -1;
+  }
+
+  walk_dir(tree, root, path);
+
+  pthread_mutex_lock(&tree->lock);
+  tree->walk_depth--;
+  dir_release(tree, root);
+  tree->walk_done = 1;
+  pthread_cond_broadcast(&tree->data_available);
+  pthread_mutex_unlock(&tree->lock);
+
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  apply_meta(tree, target_root_fd);
+  close(target_root_fd);
+
+  engine_add(total, &tree->total);
+  errors = tree->errors;
+
+  pthread_mutex_destroy(&tree->lock);
+  pthread_cond_destroy(&tree->space_available);
+  pthread_cond_destroy(&tree->data_available);
+  pthread_cond_destroy(&tree->dir_closed);
+  free(workers);
+  free(tree);
+
+  return errors;
+}
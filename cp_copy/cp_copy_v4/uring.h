@@ -0,0 +1,233 @@
+// Chapter 2 Login Records, File I/O, and Performance
+// a minimal io_uring ring, used by the uring method of copy_engine.h
+//
+// io_uring lets a program queue many I/O requests in a submission queue
+// (SQ) shared with the kernel, and collect their results from a completion
+// queue (CQ), without a system call per request. Both queues are rings in
+// memory mapped from the kernel. The C library has no wrappers for the
+// three io_uring system calls, so they are made with syscall().
+// The kernel writes the CQ tail and reads the SQ tail concurrently with
+// us, hence the acquire/release atomic loads and stores on them.
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct _uring {
+  int fd; // -1 when the ring is not set up
+  unsigned entries; // number of SQ entries
+
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_pending; // SQEs queued but not yet submitted
+
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // the memory mapped from the kernel, to be unmapped
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} uring;
+
+static inline int uring_setup_call(unsigned entries,
+                                   struct io_uring_params *params) {
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int uring_enter_call(int fd, unsigned to_submit,
+                                   unsigned min_complete, unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+static inline int uring_register_call(int fd, unsigned opcode, void *arg,
+                                      unsigned nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Unmaps the rings and closes the ring file descriptor
+ */
+static inline void uring_exit(uring *ring) {
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED &&
+      ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->fd != -1) {
+    close(ring->fd);
+  }
+
+  memset(ring, 0, sizeof(uring));
+  ring->fd = -1;
+}
+
+/**
+ * Creates a ring with room for the given number of requests
+ * and maps its queues
+ * @return: 0 on success
+ *          -1 on error, e.g. ENOSYS on kernels without io_uring, or EPERM
+ *          where it is disabled
+ */
+static inline int uring_init(uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  char *sq;
+  char *cq;
+
+  memset(ring, 0, sizeof(uring));
+  memset(&params, 0, sizeof(params));
+
+  if ((ring->fd = uring_setup_call(entries, &params)) == -1) {
+    return -1;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sq_ring_size = params.sq_off.array +
+                       params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+
+  // recent kernels map both rings with a single mmap()
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    uring_exit(ring);
+    return -1;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      uring_exit(ring);
+      return -1;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    uring_exit(ring);
+    return -1;
+  }
+
+  sq = (char*) ring->sq_ring;
+  ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+
+  cq = (char*) ring->cq_ring;
+  ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+/**
+ * Number of submission queue entries that can still be queued
+ */
+static inline unsigned uring_sq_space(uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+  return ring->entries - (*ring->sq_tail + ring->sq_pending - head);
+}
+
+/**
+ * Returns the next free submission queue entry, cleared
+ * @return: the entry or NULL if the submission queue is full
+ */
+static inline struct io_uring_sqe *uring_get_sqe(uring *ring) {
+  unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *ring->sq_tail + ring->sq_pending;
+  unsigned index;
+
+  if (tail - head >= ring->entries) {
+    return NULL;
+  }
+
+  index = tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->sq_pending++;
+  memset(&ring->sqes[index], 0, sizeof(struct io_uring_sqe));
+
+  return &ring->sqes[index];
+}
+
+/**
+ * Publishes the queued entries to the kernel and waits until at least
+ * wait_for completions are available
+ * @return: number of entries submitted
+ *          -1 on error
+ */
+static inline int uring_submit_and_wait(uring *ring, unsigned wait_for) {
+  unsigned to_submit;
+  int submitted;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->sq_pending,
+                   __ATOMIC_RELEASE);
+  ring->sq_pending = 0;
+
+  // entries a failed call left in the queue are submitted with the new ones
+  to_submit = *ring->sq_tail - __atomic_load_n(ring->sq_head,
+                                               __ATOMIC_ACQUIRE);
+
+  do {
+    submitted = uring_enter_call(ring->fd, to_submit, wait_for,
+                                 wait_for > 0 ? IORING_ENTER_GETEVENTS : 0);
+  } while (submitted == -1 && errno == EINTR);
+
+  return submitted;
+}
+
+/**
+ * Returns the oldest completion not yet consumed, without waiting
+ * @return: the completion or NULL if there is none
+ */
+static inline struct io_uring_cqe *uring_peek_cqe(uring *ring) {
+  unsigned head = *ring->cq_head;
+
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * Gives the oldest completion back to the kernel
+ */
+static inline void uring_cqe_seen(uring *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,149 @@
+// Chapter 3 File Systems and the File Hierarchy
+// the dates of a long listing, cached, used by ls_copy_v4 and ls_fts
+//
+// A long listing shows the modification time of every file as
+// "Mmm dd HH:MM", or "Mmm dd YYYY" if it is older than six months. The
+// plain way costs time(), localtime() (which checks TZ again each call in
+// glibc) and strftime() per file. Here the current time is read once, and
+// for each calendar day met the text of the day and where it starts and
+// ends are kept; the hours and minutes of a time within a known day are
+// then plain arithmetic. A day in which the offset from UTC changes
+// (daylight saving time) is not cached, its times take the full path.
+// The days are kept in a small table indexed by day number, so files
+// modified over a few weeks all hit the cache.
+#include <string.h>
+#include <time.h>
+
+#define DATE_SLOTS 64 // days kept, a power of 2
+#define SIX_MONTHS 15724800 // number of seconds in 6 months
+#define SECONDS_PER_DAY 86400
+
+typedef struct _cached_day {
+  time_t start; // local midnight
+  time_t end; // the next one; start == end for an empty slot
+  char day[8]; // "Mmm dd "
+  char old[12]; // "Mmm dd YYYY", for times older than six months
+} cached_day;
+
+typedef struct _date_cache {
+  time_t now; // when the listing started
+  long utc_offset; // seconds east of UTC, now
+  cached_day days[DATE_SLOTS];
+  char text[16]; // the last date formatted
+  long long misses; // days formatted by localtime()
+} date_cache;
+
+static inline void date_cache_init(date_cache *cache) {
+  struct tm now_tm;
+
+  memset(cache, 0, sizeof(date_cache));
+  tzset();
+  cache->now = time(NULL);
+  if (localtime_r(&cache->now, &now_tm) != NULL) {
+    cache->utc_offset = now_tm.tm_gmtoff;
+  }
+}
+
+/**
+ * The slot for the day of a time, given the UTC offset in that day
+ */
+static inline cached_day *date_slot(date_cache *cache, time_t time_eval,
+                                    long utc_offset) {
+  unsigned long day = (unsigned long) ((time_eval + utc_offset) /
+                                       SECONDS_PER_DAY);
+
+  return &cache->days[day & (DATE_SLOTS - 1)];
+}
+
+/**
+ * Finds the local day of time_eval and caches it
+ * @return: the day, or NULL if it cannot be cached
+ */
+static inline cached_day *date_cache_fill(date_cache *cache,
+                                          time_t time_eval) {
+  struct tm eval_tm;
+  struct tm edge_tm;
+  cached_day *entry;
+  time_t start;
+  time_t last;
+
+  cache->misses++;
+  if (localtime_r(&time_eval, &eval_tm) == NULL) {
+    return NULL;
+  }
+
+  start = time_eval - (eval_tm.tm_hour * 3600 + eval_tm.tm_min * 60 +
+                       eval_tm.tm_sec);
+  last = start + SECONDS_PER_DAY - 1;
+
+  // the arithmetic only holds if the offset is the same all day long
+  if (localtime_r(&start, &edge_tm) == NULL ||
+      edge_tm.tm_gmtoff != eval_tm.tm_gmtoff ||
+      localtime_r(&last, &edge_tm) == NULL ||
+      edge_tm.tm_gmtoff != eval_tm.tm_gmtoff) {
+    return NULL;
+  }
+
+  entry = date_slot(cache, start, eval_tm.tm_gmtoff);
+  entry->start = start;
+  entry->end = start + SECONDS_PER_DAY;
+  strftime(entry->day, sizeof(entry->day), "%b %e ", &eval_tm);
+  strftime(entry->old, sizeof(entry->old), "%b %e %Y", &eval_tm);
+
+  return entry;
+}
+
+/**
+ * Formats a time the slow way, for the days that cannot be cached
+ */
+static inline char *date_format_full(date_cache *cache, time_t time_eval) {
+  struct tm eval_tm;
+
+  if (localtime_r(&time_eval, &eval_tm) == NULL) {
+    perror("get_date_no_day: localtime");
+    cache->text[0] = '\0';
+  } else if (cache->now - time_eval > SIX_MONTHS) {
+      strftime(cache->text, sizeof(cache->text), "%b %e %Y", &eval_tm);
+  } else {
+      strftime(cache->text, sizeof(cache->text), "%b %e %H:%M", &eval_tm);
+  }
+
+  return cache->text;
+}
+
+/**
+ * Format the time of the file depending
+ * if the file is less than 6 months "%b %e %H:%M"
+ * else "%b %e %Y"
+ * The string belongs to the cache, and is overwritten by the next call.
+ */
+static inline char *date_cache_format(date_cache *cache, time_t time_eval) {
+  cached_day *entry = date_slot(cache, time_eval, cache->utc_offset);
+  long seconds;
+  int hours;
+  int minutes;
+
+  if (time_eval < entry->start || time_eval >= entry->end) {
+    if ((entry = date_cache_fill(cache, time_eval)) == NULL) {
+      return date_format_full(cache, time_eval);
+    }
+  }
+
+  if (cache->now - time_eval > SIX_MONTHS) {
+    return entry->old;
+  }
+
+  seconds = (long) (time_eval - entry->start);
+  hours = (int) (seconds / 3600);
+  minutes = (int) (seconds % 3600 / 60);
+
+  memcpy(cache->text, entry->day, 7);
+  cache->text[7] = '0' + hours / 10;
+  cache->text[8] = '0' + hours % 10;
+  cache->text[9] = ':';
+  cache->text[10] = '0' + minutes / 10;
+  cache->text[11] = '0' + minutes % 10;
+  cache->text[12] = '\0';
+
+  return cache->text;
+}
@@ -0,0 +1,201 @@
+// Chapter 3 File Systems and the File Hierarchy
+// reading a whole directory with getdents64(), used by ls_copy_v4
+//
+// readdir() hands out one entry per call; under it, the C library fills a
+// buffer of a few pages with getdents64() and copies each entry out of it.
+// For a directory of millions of entries it is cheaper to call getdents64()
+// ourselves, with a buffer of DIR_BUFFER_SIZE bytes, and to parse the records
+// where the kernel left them. The C library has no wrapper for it before
+// glibc 2.30, so it is made with syscall().
+// The entries are kept in an arena: one array of fixed size records and one
+// block of names, each grown by doubling, so there is no allocation per
+// entry and the arena is reused from one directory to the next. A record
+// refers to its name by offset, as the block of names moves when it grows.
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define DIR_BUFFER_SIZE (1024 * 1024) // bytes asked of each getdents64()
+#define DIR_ENTRIES 1024 // records the arena starts with
+#define DIR_NAMES (16 * 1024) // bytes of names the arena starts with
+
+// a record as getdents64() writes it
+typedef struct _kernel_dirent {
+  uint64_t d_ino;
+  int64_t d_off; // offset of the next record, for lseek()
+  unsigned short d_reclen; // length of this record
+  unsigned char d_type;
+  char d_name[]; // NUL terminated, padded to 8 bytes
+} kernel_dirent;
+
+typedef struct _dir_entry {
+  uint64_t inode;
+  size_t name_offset; // in the names of the arena
+  unsigned short name_length; // without the NUL
+  unsigned char type; // DT_REG, DT_DIR, ... or DT_UNKNOWN
+} dir_entry;
+
+typedef struct _dir_arena {
+  dir_entry *entries;
+  size_t count;
+  size_t capacity;
+  char *names; // NUL terminated, one after the other
+  size_t names_used;
+  size_t names_capacity;
+  char *buffer; // for getdents64()
+  long long syscalls; // getdents64() calls made
+} dir_arena;
+
+/**
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int dir_arena_init(dir_arena *arena) {
+  memset(arena, 0, sizeof(dir_arena));
+  arena->entries = malloc(DIR_ENTRIES * sizeof(dir_entry));
+  arena->names = malloc(DIR_NAMES);
+  arena->buffer = malloc(DIR_BUFFER_SIZE);
+
+  if (arena->entries == NULL || arena->names == NULL ||
+      arena->buffer == NULL) {
+    free(arena->entries);
+    free(arena->names);
+    free(arena->buffer);
+    errno = ENOMEM;
+    return -1;
+  }
+  arena->capacity = DIR_ENTRIES;
+  arena->names_capacity = DIR_NAMES;
+
+  return 0;
+}
+
+static inline void dir_arena_free(dir_arena *arena) {
+  free(arena->entries);
+  free(arena->names);
+  free(arena->buffer);
+  memset(arena, 0, sizeof(dir_arena));
+}
+
+/**
+ * Empties the arena, keeping its memory for the next directory
+ */
+static inline void dir_arena_reset(dir_arena *arena) {
+  arena->count = 0;
+  arena->names_used = 0;
+}
+
+static inline char *dir_entry_name(dir_arena *arena, dir_entry *entry) {
+  return arena->names + entry->name_offset;
+}
+
+/**
+ * Makes room for entries more records and names_length more bytes of names
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int dir_arena_reserve(dir_arena *arena, size_t entries,
+                                    size_t names_length) {
+  size_t capacity = arena->capacity;
+  size_t names_capacity = arena->names_capacity;
+  void *grown;
+
+  while (arena->count + entries > capacity) {
+    capacity *= 2;
+  }
+  while (arena->names_used + names_length > names_capacity) {
+    names_capacity *= 2;
+  }
+
+  if (capacity != arena->capacity) {
+    if ((grown = realloc(arena->entries, capacity * sizeof(dir_entry)))
+        == NULL) {
+      return -1;
+    }
+    arena->entries = grown;
+    arena->capacity = capacity;
+  }
+
+  if (names_capacity != arena->names_capacity) {
+    if ((grown = realloc(arena->names, names_capacity)) == NULL) {
+      return -1;
+    }
+    arena->names = grown;
+    arena->names_capacity = names_capacity;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads the next batch of entries of the directory open on fd and adds
+ * them to the arena, leaving out "." and ".."
+ * @return: number of entries added, 0 at the end of the directory
+ *          -1 on error
+ */
+static inline long dir_read_batch(dir_arena *arena, int fd) {
+  kernel_dirent *record;
+  dir_entry *entry;
+  long n_bytes;
+  long position;
+  size_t length;
+  size_t first = arena->count;
+
+  // a batch may hold nothing but "." and "..", so read until one adds
+  // entries or the directory ends
+  while (arena->count == first) {
+    arena->syscalls++;
+    n_bytes = syscall(SYS_getdents64, fd, arena->buffer, DIR_BUFFER_SIZE);
+    if (n_bytes == -1 && errno == EINTR) {
+      continue;
+    } else if (n_bytes <= 0) {
+      return n_bytes;
+    }
+
+    // the names of a batch take less room than its records, so one
+    // reservation covers the whole batch
+    if (dir_arena_reserve(arena, n_bytes / sizeof(kernel_dirent) + 1,
+                          n_bytes) == -1) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    for (position = 0; position < n_bytes; position += record->d_reclen) {
+      record = (kernel_dirent*) (arena->buffer + position);
+
+      if (record->d_name[0] == '.' && (record->d_name[1] == '\0' ||
+          (record->d_name[1] == '.' && record->d_name[2] == '\0'))) {
+        continue; // skip dot and dot-dot entries
+      }
+
+      length = strlen(record->d_name);
+      entry = &arena->entries[arena->count++];
+      entry->inode = record->d_ino;
+      entry->name_offset = arena->names_used;
+      entry->name_length = (unsigned short) length;
+      entry->type = record->d_type;
+      memcpy(arena->names + arena->names_used, record->d_name, length + 1);
+      arena->names_used += length + 1;
+    }
+  }
+
+  return (long) (arena->count - first);
+}
+
+/**
+ * Reads every entry of the directory open on fd into the arena
+ * @return: number of entries in the arena
+ *          -1 on error, the entries read before it are kept
+ */
+static inline long dir_read_all(dir_arena *arena, int fd) {
+  long n;
+
+  while ((n = dir_read_batch(arena, fd)) > 0) {
+    ;
+  }
+
+  return (n == -1) ? -1 : (long) arena->count;
+}
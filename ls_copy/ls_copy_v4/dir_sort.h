@@ -0,0 +1,325 @@
+// Chapter 3 File Systems and the File Hierarchy
+// sorting a directory by name within a memory budget, used by ls_copy_v4
+//
+// A sorted listing cannot print its first line before it has read the
+// last entry, so it holds the whole directory: gigabytes for tens of
+// millions of entries. Here the entries are read into the arena until it
+// holds more than the budget; the arena is then sorted and written to a
+// temporary file as a "run", and emptied for the next entries. At the end
+// the runs are merged: each run is read in order, a heap keeps the run
+// with the smallest next name on top, and the names come out in batches
+// of MERGE_BATCH. Memory is thus bounded by the budget, plus a buffer per
+// run while merging. A directory that fits in the budget is sorted in
+// memory and never touches a file.
+// The runs are unlinked as soon as they are created, in $TMPDIR or /tmp,
+// so nothing is left behind if ls is killed.
+// Requires dir_reader.h and key_sort.h.
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_SORT_BUDGET (256 * 1024 * 1024) // bytes of entries in memory
+#define MERGE_BATCH 4096 // entries merged before they are listed
+#define RUN_BUFFER_SIZE (64 * 1024) // stdio buffer of each run
+
+typedef struct _sort_run {
+  FILE *file;
+  dir_entry entry; // the next entry of the run
+  char name[NAME_MAX + 1]; // and its name
+} sort_run;
+
+typedef struct _dir_sort {
+  size_t budget; // bytes of entries and names the arena may hold
+  sort_run *runs;
+  int num_runs;
+  int capacity;
+  int *heap; // runs that still have entries, smallest name first
+  int heap_size;
+} dir_sort;
+
+static inline void dir_sort_init(dir_sort *sort, size_t budget) {
+  memset(sort, 0, sizeof(dir_sort));
+  sort->budget = budget;
+}
+
+static inline void dir_sort_free(dir_sort *sort) {
+  int i;
+
+  for (i = 0; i < sort->num_runs; i++) {
+    fclose(sort->runs[i].file);
+  }
+  free(sort->runs);
+  free(sort->heap);
+  memset(sort, 0, sizeof(dir_sort));
+}
+
+/**
+ * Bytes of entries and names in the arena
+ */
+static inline size_t dir_arena_bytes(dir_arena *arena) {
+  return arena->count * sizeof(dir_entry) + arena->names_used;
+}
+
+/**
+ * Sorts the entries of the arena by name, as strcoll() orders them
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int dir_arena_sort(dir_arena *arena) {
+  char **names = malloc(arena->count * sizeof(char*) + 1);
+  uint64_t *ranks = malloc(arena->count * sizeof(uint64_t) + 1);
+  uint32_t *order = malloc(arena->count * sizeof(uint32_t) + 1);
+  dir_entry *sorted = malloc(arena->count * sizeof(dir_entry) + 1);
+  int result = -1;
+  size_t i;
+
+  if (names != NULL && ranks != NULL && order != NULL && sorted != NULL) {
+    for (i = 0; i < arena->count; i++) {
+      names[i] = dir_entry_name(arena, &arena->entries[i]);
+    }
+
+    if (name_ranks(names, arena->count, ranks) == 0 &&
+        key_sort(&ranks, 1, arena->count, order) == 0) {
+      for (i = 0; i < arena->count; i++) {
+        sorted[i] = arena->entries[order[i]];
+      }
+      memcpy(arena->entries, sorted, arena->count * sizeof(dir_entry));
+      result = 0;
+    }
+  }
+
+  free(names);
+  free(ranks);
+  free(order);
+  free(sorted);
+
+  if (result == -1) {
+    errno = ENOMEM;
+  }
+  return result;
+}
+
+/**
+ * Opens an anonymous temporary file for a run
+ * @return: the file, or NULL on error
+ */
+static inline FILE *run_create(void) {
+  const char *directory = getenv("TMPDIR");
+  char path[PATH_MAX];
+  FILE *file;
+  int fd;
+
+  if (directory == NULL || *directory == '\0') {
+    directory = "/tmp";
+  }
+  snprintf(path, sizeof(path), "%s/ls_copy_v4.XXXXXX", directory);
+
+  if ((fd = mkstemp(path)) == -1) {
+    return NULL;
+  }
+  unlink(path); // gone once closed
+
+  if ((file = fdopen(fd, "w+")) == NULL) {
+    close(fd);
+    return NULL;
+  }
+  setvbuf(file, NULL, _IOFBF, RUN_BUFFER_SIZE);
+
+  return file;
+}
+
+/**
+ * Sorts the arena, writes it out as a new run and empties it
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int dir_sort_spill(dir_sort *sort, dir_arena *arena) {
+  sort_run *runs;
+  dir_entry *entry;
+  FILE *file;
+  size_t i;
+
+  if (sort->num_runs == sort->capacity) {
+    sort->capacity = (sort->capacity == 0) ? 8 : 2 * sort->capacity;
+    if ((runs = realloc(sort->runs, sort->capacity * sizeof(sort_run)))
+        == NULL) {
+      return -1;
+    }
+    sort->runs = runs;
+  }
+
+  if (dir_arena_sort(arena) == -1 || (file = run_create()) == NULL) {
+    return -1;
+  }
+  sort->runs[sort->num_runs++].file = file;
+
+  // each record: inode, length of the name, type, and the name
+  for (i = 0; i < arena->count; i++) {
+    entry = &arena->entries[i];
+    if (fwrite(&entry->inode, sizeof(entry->inode), 1, file) != 1 ||
+        fwrite(&entry->name_length, sizeof(entry->name_length), 1,
+               file) != 1 ||
+        fwrite(&entry->type, sizeof(entry->type), 1, file) != 1 ||
+        fwrite(dir_entry_name(arena, entry), 1, entry->name_length,
+               file) != entry->name_length) {
+      return -1;
+    }
+  }
+
+  if (fflush(file) == EOF) {
+    return -1;
+  }
+
+  dir_arena_reset(arena);
+  return 0;
+}
+
+/**
+ * Reads every entry of the directory open on fd, spilling runs whenever
+ * the arena holds more than the budget. Without runs, the arena holds the
+ * whole directory, sorted; otherwise it is spilled too, and the entries
+ * come from dir_sort_next_batch().
+ * @return: 0 on success
+ *          -1 on error, the entries read before it can still be listed
+ */
+static inline int dir_read_sorted(dir_sort *sort, dir_arena *arena, int fd) {
+  long n;
+  int result = 0;
+
+  while ((n = dir_read_batch(arena, fd)) > 0) {
+    if (dir_arena_bytes(arena) > sort->budget &&
+        dir_sort_spill(sort, arena) == -1) {
+      return -1;
+    }
+  }
+  if (n == -1) {
+    result = -1;
+  }
+
+  if (sort->num_runs == 0) {
+    if (dir_arena_sort(arena) == -1) {
+      result = -1;
+    }
+  } else if (arena->count > 0 && dir_sort_spill(sort, arena) == -1) {
+      result = -1;
+  }
+
+  return result;
+}
+
+/**
+ * Reads the next record of a run
+ * @return: 1 if there is one, 0 at the end of the run
+ */
+static inline int run_next(sort_run *run) {
+  dir_entry *entry = &run->entry;
+
+  if (fread(&entry->inode, sizeof(entry->inode), 1, run->file) != 1 ||
+      fread(&entry->name_length, sizeof(entry->name_length), 1,
+            run->file) != 1 ||
+      fread(&entry->type, sizeof(entry->type), 1, run->file) != 1 ||
+      entry->name_length > NAME_MAX ||
+      fread(run->name, 1, entry->name_length, run->file) !=
+      entry->name_length) {
+    return 0;
+  }
+  run->name[entry->name_length] = '\0';
+
+  return 1;
+}
+
+static inline int run_less(dir_sort *sort, int a, int b) {
+  return strcoll(sort->runs[a].name, sort->runs[b].name) < 0;
+}
+
+/**
+ * Moves the run at position i of the heap down to its place
+ */
+static inline void heap_down(dir_sort *sort, int i) {
+  int child;
+  int swap;
+
+  while ((child = 2 * i + 1) < sort->heap_size) {
+    if (child + 1 < sort->heap_size &&
+        run_less(sort, sort->heap[child + 1], sort->heap[child])) {
+      child++;
+    }
+    if (!run_less(sort, sort->heap[child], sort->heap[i])) {
+      break;
+    }
+    swap = sort->heap[i];
+    sort->heap[i] = sort->heap[child];
+    sort->heap[child] = swap;
+    i = child;
+  }
+}
+
+/**
+ * Rewinds the runs and reads their first entries, to merge them
+ * @return: 0 on success
+ *          -1 on error
+ */
+static inline int dir_sort_merge(dir_sort *sort) {
+  int i;
+
+  if ((sort->heap = malloc(sort->num_runs * sizeof(int) + 1)) == NULL) {
+    return -1;
+  }
+
+  sort->heap_size = 0;
+  for (i = 0; i < sort->num_runs; i++) {
+    if (fseek(sort->runs[i].file, 0, SEEK_SET) == -1) {
+      return -1;
+    }
+    if (run_next(&sort->runs[i])) {
+      sort->heap[sort->heap_size++] = i;
+    }
+  }
+
+  for (i = sort->heap_size / 2 - 1; i >= 0; i--) {
+    heap_down(sort, i);
+  }
+
+  return 0;
+}
+
+/**
+ * Empties the arena and fills it with the next MERGE_BATCH entries of
+ * the merged runs
+ * @return: number of entries, 0 once the runs are all read
+ *          -1 on error
+ */
+static inline long dir_sort_next_batch(dir_sort *sort, dir_arena *arena) {
+  sort_run *run;
+  dir_entry *entry;
+
+  dir_arena_reset(arena);
+  while (arena->count < MERGE_BATCH && sort->heap_size > 0) {
+    run = &sort->runs[sort->heap[0]];
+
+    if (dir_arena_reserve(arena, 1, run->entry.name_length + 1) == -1) {
+      return -1;
+    }
+    entry = &arena->entries[arena->count++];
+    *entry = run->entry;
+    entry->name_offset = arena->names_used;
+    memcpy(arena->names + arena->names_used, run->name,
+           run->entry.name_length + 1);
+    arena->names_used += run->entry.name_length + 1;
+
+    if (!run_next(run)) {
+      if (ferror(run->file)) {
+        errno = EIO;
+        return -1;
+      }
+      sort->heap[0] = sort->heap[--sort->heap_size];
+    }
+    heap_down(sort, 0);
+  }
+
+  return (long) arena->count;
+}
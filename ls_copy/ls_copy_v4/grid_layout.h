@@ -0,0 +1,183 @@
+// Chapter 3 File Systems and the File Hierarchy
+// the layout of names in columns, as ls prints them on a terminal
+//
+// The names go down the first column, then the next, and each column is
+// as wide as its longest name, plus 2 spaces before the next one; the
+// last column takes at least MIN_COLUMN_WIDTH, as in GNU ls. The layout
+// keeps the most columns that fit in the line, short of its last
+// character, where a terminal would wrap. With c columns, each column is
+// a block of ceil(n / c) consecutive names, so trying a count of columns
+// only needs the longest name of each block: a range maximum. The widths
+// are cut into blocks of RANGE_BLOCK names, with the maximum up to and
+// from each name within its block, and a sparse table over the maxima of
+// the blocks: any range maximum then takes O(1), after O(n) work and
+// memory to build them. A count of columns costs at most c lookups, and
+// no more than line_width / 3 counts can fit at all, so the names are
+// read once whatever the size of the directory, instead of once for each
+// count of columns tried.
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANGE_BLOCK 64 // widths per block of the range maximum
+#define MIN_COLUMN_WIDTH 3 // one character and two spaces
+
+typedef struct _range_max {
+  const unsigned short *values;
+  size_t count;
+  unsigned short *prefix; // maximum from the start of the block to i
+  unsigned short *suffix; // maximum from i to the end of the block
+  unsigned short *table; // level k: maximum of 2^k blocks from block i
+  size_t num_blocks;
+} range_max;
+
+static inline void range_max_free(range_max *range) {
+  free(range->prefix);
+  free(range->suffix);
+  free(range->table);
+}
+
+static inline unsigned short max_of(unsigned short a, unsigned short b) {
+  return (a > b) ? a : b;
+}
+
+/**
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int range_max_init(range_max *range,
+                                 const unsigned short *values, size_t count) {
+  unsigned short *level;
+  size_t num_levels = 1;
+  size_t i;
+  size_t k;
+
+  range->values = values;
+  range->count = count;
+  range->num_blocks = (count + RANGE_BLOCK - 1) / RANGE_BLOCK;
+  while (((size_t) 1 << num_levels) <= range->num_blocks) {
+    num_levels++;
+  }
+
+  range->prefix = malloc(count * sizeof(unsigned short) + 1);
+  range->suffix = malloc(count * sizeof(unsigned short) + 1);
+  range->table = malloc(num_levels * range->num_blocks *
+                        sizeof(unsigned short) + 1);
+  if (range->prefix == NULL || range->suffix == NULL ||
+      range->table == NULL) {
+    range_max_free(range);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    range->prefix[i] = (i % RANGE_BLOCK == 0) ? values[i]
+                       : max_of(range->prefix[i - 1], values[i]);
+  }
+  for (i = count; i-- > 0; ) {
+    range->suffix[i] = (i % RANGE_BLOCK == RANGE_BLOCK - 1 || i == count - 1)
+                       ? values[i] : max_of(range->suffix[i + 1], values[i]);
+  }
+
+  // the last prefix of a block is its maximum
+  for (i = 0; i < range->num_blocks; i++) {
+    k = (i + 1) * RANGE_BLOCK - 1;
+    range->table[i] = range->prefix[(k < count) ? k : count - 1];
+  }
+  for (k = 1; k < num_levels; k++) {
+    level = range->table + k * range->num_blocks;
+    for (i = 0; i + ((size_t) 1 << k) <= range->num_blocks; i++) {
+      level[i] = max_of(level[i - range->num_blocks],
+                        level[i - range->num_blocks + ((size_t) 1 << (k - 1))]);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * The largest of the values from first to last, both included
+ */
+static inline unsigned short range_max_query(range_max *range, size_t first,
+                                             size_t last) {
+  size_t first_block = first / RANGE_BLOCK;
+  size_t last_block = last / RANGE_BLOCK;
+  unsigned short result;
+  unsigned short *level;
+  size_t k;
+
+  if (first_block == last_block) {
+    result = range->values[first];
+    while (++first <= last) {
+      result = max_of(result, range->values[first]);
+    }
+    return result;
+  }
+
+  result = max_of(range->suffix[first], range->prefix[last]);
+  if (++first_block < last_block) {
+    k = 63 - __builtin_clzll(last_block - first_block);
+    level = range->table + k * range->num_blocks;
+    result = max_of(result, max_of(level[first_block],
+                                   level[last_block - ((size_t) 1 << k)]));
+  }
+
+  return result;
+}
+
+/**
+ * Lays out count names of the given widths in columns narrower than
+ * line_width, as many columns as possible. The width of each column,
+ * without the 2 spaces after it, goes to column_widths, which has room for
+ * line_width / MIN_COLUMN_WIDTH + 1 of them.
+ * @return: the number of columns, and the rows in *rows
+ *          -1 if out of memory
+ */
+static inline int grid_layout(const unsigned short *widths, size_t count,
+                              int line_width, unsigned short *column_widths,
+                              size_t *rows) {
+  range_max range;
+  size_t columns;
+  size_t total;
+  size_t j;
+  size_t c;
+
+  *rows = count;
+  if (count <= 1) {
+    column_widths[0] = (count == 1) ? widths[0] : 0;
+    return 1;
+  }
+  if (range_max_init(&range, widths, count) == -1) {
+    return -1;
+  }
+
+  c = (line_width + 1) / MIN_COLUMN_WIDTH;
+  if (c > count) {
+    c = count;
+  }
+
+  for (; c > 1; c--) {
+    *rows = (count + c - 1) / c;
+    columns = (count + *rows - 1) / *rows; // fewer if the last are empty
+    if (columns != c) {
+      continue; // the same layout as a count of columns tried later
+    }
+
+    total = 0;
+    for (j = 0; j < columns && total < (size_t) line_width; j++) {
+      column_widths[j] = range_max_query(&range, j * *rows,
+          ((j + 1) * *rows < count) ? (j + 1) * *rows - 1 : count - 1);
+      total += (j + 1 < columns) ? column_widths[j] + 2
+               : max_of(column_widths[j], MIN_COLUMN_WIDTH);
+    }
+    if (total < (size_t) line_width) {
+      range_max_free(&range);
+      return (int) columns;
+    }
+  }
+
+  *rows = count;
+  column_widths[0] = range_max_query(&range, 0, count - 1);
+  range_max_free(&range);
+  return 1;
+}
@@ -0,0 +1,193 @@
+// Chapter 3 File Systems and the File Hierarchy
+// user and group names by id, cached, used by ls_copy_v4 and ls_fts
+//
+// getpwuid() and getgrgid() go through NSS, which may read /etc/passwd
+// again or ask an LDAP server, for every call; a long listing makes two
+// per file, though a directory rarely has more than a few owners. Each id
+// is looked up once and its name kept in a hash table, including the ids
+// that have no name ("negative" entries, shown as the number), since those
+// are the slowest to look up. The table uses open addressing with linear
+// probing and doubles when half full.
+// id_cache_preload() reads the whole database in one pass with getpwent()
+// or getgrent() instead; ids it does not list (NSS may not enumerate LDAP)
+// are still looked up one by one.
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define ID_CACHE_SLOTS 64 // slots the table starts with, a power of 2
+
+typedef struct _id_name {
+  int used; // 0 if the slot is empty
+  unsigned id;
+  int found; // 0 for an id that has no name
+  char *name; // the name, or the id as a string
+} id_name;
+
+typedef struct _id_cache {
+  int groups; // 1 for group ids, 0 for user ids
+  id_name *slots;
+  size_t size; // number of slots
+  size_t count; // slots used
+  long long lookups; // calls to getpwuid() or getgrgid()
+} id_cache;
+
+/**
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int id_cache_init(id_cache *cache, int groups) {
+  memset(cache, 0, sizeof(id_cache));
+  cache->groups = groups;
+  if ((cache->slots = calloc(ID_CACHE_SLOTS, sizeof(id_name))) == NULL) {
+    return -1;
+  }
+  cache->size = ID_CACHE_SLOTS;
+
+  return 0;
+}
+
+static inline void id_cache_free(id_cache *cache) {
+  size_t i;
+
+  for (i = 0; i < cache->size; i++) {
+    free(cache->slots[i].name);
+  }
+  free(cache->slots);
+  memset(cache, 0, sizeof(id_cache));
+}
+
+/**
+ * The slot of id: the one holding it, or the empty one it would go in
+ */
+static inline id_name *id_cache_slot(id_name *slots, size_t size,
+                                     unsigned id) {
+  size_t i = (size_t) ((id * 2654435761u) & (size - 1)); // multiplicative
+
+  while (slots[i].used && slots[i].id != id) {
+    i = (i + 1) & (size - 1);
+  }
+
+  return &slots[i];
+}
+
+/**
+ * Doubles the table
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int id_cache_grow(id_cache *cache) {
+  size_t size = cache->size * 2;
+  id_name *slots;
+  size_t i;
+
+  if ((slots = calloc(size, sizeof(id_name))) == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < cache->size; i++) {
+    if (cache->slots[i].used) {
+      *id_cache_slot(slots, size, cache->slots[i].id) = cache->slots[i];
+    }
+  }
+
+  free(cache->slots);
+  cache->slots = slots;
+  cache->size = size;
+
+  return 0;
+}
+
+/**
+ * Adds id to the cache, unless it is there already; name is NULL for an
+ * id that has no name
+ * @return: the entry of id, or NULL if out of memory
+ */
+static inline id_name *id_cache_add(id_cache *cache, unsigned id,
+                                    const char *name) {
+  char number[16];
+  id_name *entry;
+
+  if (2 * (cache->count + 1) > cache->size && id_cache_grow(cache) == -1) {
+    return NULL;
+  }
+
+  entry = id_cache_slot(cache->slots, cache->size, id);
+  if (entry->used) {
+    return entry; // the first name of an id is the one getpwuid() returns
+  }
+
+  if (name == NULL) {
+    snprintf(number, sizeof(number), "%u", id);
+  }
+  if ((entry->name = strdup(name != NULL ? name : number)) == NULL) {
+    return NULL;
+  }
+  entry->used = 1;
+  entry->id = id;
+  entry->found = (name != NULL);
+  cache->count++;
+
+  return entry;
+}
+
+/**
+ * Reads the whole user or group database into the cache
+ */
+static inline void id_cache_preload(id_cache *cache) {
+  struct passwd *password_pointer;
+  struct group *group_pointer;
+
+  if (cache->groups) {
+    setgrent();
+    while ((group_pointer = getgrent()) != NULL) {
+      id_cache_add(cache, group_pointer->gr_gid, group_pointer->gr_name);
+    }
+    endgrent();
+  } else {
+      setpwent();
+      while ((password_pointer = getpwent()) != NULL) {
+        id_cache_add(cache, password_pointer->pw_uid,
+                     password_pointer->pw_name);
+      }
+      endpwent();
+  }
+}
+
+/**
+ * Given an id, return its name if possible, else the id as a string.
+ * The string belongs to the cache.
+ */
+static inline char *id_cache_name(id_cache *cache, unsigned id) {
+  static char number[16]; // only if the cache is out of memory
+  struct passwd *password_pointer;
+  struct group *group_pointer;
+  id_name *entry = id_cache_slot(cache->slots, cache->size, id);
+  const char *name = NULL;
+
+  if (entry->used) {
+    return entry->name;
+  }
+
+  cache->lookups++;
+  if (cache->groups) {
+    if ((group_pointer = getgrgid(id)) != NULL) {
+      name = group_pointer->gr_name;
+    }
+  } else if ((password_pointer = getpwuid(id)) != NULL) {
+      name = password_pointer->pw_name;
+  }
+
+  if ((entry = id_cache_add(cache, id, name)) == NULL) {
+    if (name != NULL) {
+      return (char*) name;
+    }
+    snprintf(number, sizeof(number), "%u", id);
+    return number;
+  }
+
+  return entry->name;
+}
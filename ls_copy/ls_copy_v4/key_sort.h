@@ -0,0 +1,216 @@
+// Chapter 3 File Systems and the File Hierarchy
+// sorting a listing on precomputed keys, used by ls_fts
+//
+// A sort that calls a comparison function compares each entry about
+// log2(n) times, and each time goes back to its struct stat, or collates
+// its name again with strcoll(). Here every sort key is turned once into
+// an unsigned 64-bit number that orders the same way, in one array per
+// key, and the entries are sorted on those numbers with a radix sort:
+//   - sizes and times are signed; flipping the sign bit makes them order
+//     as unsigned numbers.
+//   - a name gets its rank among the names, found by sorting the strxfrm()
+//     forms of the names once with strcmp(), which orders them as
+//     strcoll() orders the names themselves.
+// The radix sort is stable and goes 8 bits at a time, from the lowest,
+// skipping the bytes in which all keys are the same (the high bytes of
+// sizes, of times, of ranks). With several keys, the entries are sorted
+// on the last key first and then on each key before it: stability keeps
+// the earlier passes as tie-breaks, so the first key orders them.
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES (64 / RADIX_BITS)
+
+typedef struct _sort_item {
+  uint64_t key;
+  uint32_t index; // of the entry
+} sort_item;
+
+typedef struct _name_key {
+  char *xfrm; // strxfrm() of the name
+  uint32_t index;
+} name_key;
+
+/**
+ * A signed number as an unsigned one that orders the same way
+ */
+static inline uint64_t signed_key(int64_t value) {
+  return (uint64_t) value ^ (1ULL << 63);
+}
+
+/**
+ * Sorts count items by key, keeping the order of equal keys;
+ * scratch must hold count items
+ */
+static inline void radix_sort(sort_item *items, sort_item *scratch,
+                              size_t count) {
+  size_t counts[RADIX_PASSES][RADIX_BUCKETS];
+  size_t offsets[RADIX_BUCKETS];
+  sort_item *from = items;
+  sort_item *to = scratch;
+  sort_item *swap;
+  size_t total;
+  size_t i;
+  int pass;
+  int digit;
+
+  if (count == 0) {
+    return;
+  }
+
+  // the counts of every pass are taken in one read of the keys
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < count; i++) {
+    for (pass = 0; pass < RADIX_PASSES; pass++) {
+      counts[pass][(items[i].key >> (pass * RADIX_BITS)) &
+                   (RADIX_BUCKETS - 1)]++;
+    }
+  }
+
+  for (pass = 0; pass < RADIX_PASSES; pass++) {
+    // a byte that is the same in every key does not change the order
+    digit = (int) ((items[0].key >> (pass * RADIX_BITS)) &
+                   (RADIX_BUCKETS - 1));
+    if (counts[pass][digit] == count) {
+      continue;
+    }
+
+    for (total = 0, digit = 0; digit < RADIX_BUCKETS; digit++) {
+      offsets[digit] = total;
+      total += counts[pass][digit];
+    }
+
+    for (i = 0; i < count; i++) {
+      digit = (int) ((from[i].key >> (pass * RADIX_BITS)) &
+                     (RADIX_BUCKETS - 1));
+      to[offsets[digit]++] = from[i];
+    }
+
+    swap = from;
+    from = to;
+    to = swap;
+  }
+
+  if (from != items) {
+    memcpy(items, from, count * sizeof(sort_item));
+  }
+}
+
+static int name_key_cmp(const void *a, const void *b) {
+  const name_key *key_a = (const name_key*) a;
+  const name_key *key_b = (const name_key*) b;
+  int result = strcmp(key_a->xfrm, key_b->xfrm);
+
+  if (result == 0) {
+    result = (key_a->index > key_b->index) - (key_a->index < key_b->index);
+  }
+
+  return result;
+}
+
+/**
+ * The rank of each name in collating order; equal names get equal ranks
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int name_ranks(char **names, size_t count, uint64_t *ranks) {
+  name_key *keys;
+  char *arena;
+  size_t *lengths;
+  size_t total = 0;
+  size_t used = 0;
+  uint64_t rank = 0;
+  size_t i;
+
+  keys = malloc(count * sizeof(name_key) + 1);
+  lengths = malloc(count * sizeof(size_t) + 1);
+  if (keys == NULL || lengths == NULL) {
+    free(keys);
+    free(lengths);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  // the strxfrm() forms go one after the other in a single block
+  for (i = 0; i < count; i++) {
+    lengths[i] = strxfrm(NULL, names[i], 0) + 1;
+    total += lengths[i];
+  }
+
+  if ((arena = malloc(total + 1)) == NULL) {
+    free(keys);
+    free(lengths);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    keys[i].xfrm = arena + used;
+    keys[i].index = (uint32_t) i;
+    strxfrm(keys[i].xfrm, names[i], lengths[i]);
+    used += lengths[i];
+  }
+
+  qsort(keys, count, sizeof(name_key), name_key_cmp);
+
+  for (i = 0; i < count; i++) {
+    if (i > 0 && strcmp(keys[i - 1].xfrm, keys[i].xfrm) != 0) {
+      rank++;
+    }
+    ranks[keys[i].index] = rank;
+  }
+
+  free(arena);
+  free(keys);
+  free(lengths);
+
+  return 0;
+}
+
+/**
+ * Orders count entries on num_keys keys: keys[0][i] is the first key of
+ * entry i, keys[1][i] breaks its ties, and so on. Equal entries stay in
+ * their order.
+ * @return: 0 on success, with order[0] the index of the first entry
+ *          -1 if out of memory
+ */
+static inline int key_sort(uint64_t **keys, int num_keys, size_t count,
+                           uint32_t *order) {
+  sort_item *items;
+  sort_item *scratch;
+  size_t i;
+  int k;
+
+  items = malloc(count * sizeof(sort_item) + 1);
+  scratch = malloc(count * sizeof(sort_item) + 1);
+  if (items == NULL || scratch == NULL) {
+    free(items);
+    free(scratch);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    items[i].index = (uint32_t) i;
+  }
+
+  for (k = num_keys - 1; k >= 0; k--) {
+    for (i = 0; i < count; i++) {
+      items[i].key = keys[k][items[i].index];
+    }
+    radix_sort(items, scratch, count);
+  }
+
+  for (i = 0; i < count; i++) {
+    order[i] = items[i].index;
+  }
+
+  free(items);
+  free(scratch);
+
+  return 0;
+}
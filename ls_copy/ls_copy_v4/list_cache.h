@@ -0,0 +1,148 @@
+// Chapter 3 File Systems and the File Hierarchy
+// the protocol between ls_cached and ls_copy_v4 -s, and its client side
+//
+// ls_cached keeps the entries of the directories it is asked about, and
+// their stat, up to date with inotify. A query goes over a UNIX stream
+// socket as one line: 's' for the entries sorted by name or 'f' for any
+// order, a space, the absolute path of the directory, and '\n'.
+// The answer is an int, 0 or the errno of the failure, then one record per
+// entry: the length of its name (an unsigned short), its struct stat and
+// its name, without NUL. A length of 0 ends the answer.
+// Both ends run on the same host, so the numbers are sent as they are.
+// Requires dir_reader.h.
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define CACHE_READ_SIZE (64 * 1024) // bytes read from the socket at a time
+
+typedef struct _cache_reader {
+  int fd; // the socket
+  char buffer[CACHE_READ_SIZE];
+  size_t start; // first byte not yet used
+  size_t end; // end of what was read
+} cache_reader;
+
+/**
+ * Copies length bytes of the answer to data, reading more as needed
+ * @return: 0 on success
+ *          -1 on error, or if the daemon closed the socket early
+ */
+static inline int cache_read(cache_reader *reader, void *data, size_t length) {
+  ssize_t n_chars;
+  size_t part;
+
+  while (length > 0) {
+    if (reader->start == reader->end) {
+      n_chars = read(reader->fd, reader->buffer, CACHE_READ_SIZE);
+      if (n_chars == -1) {
+        if (errno == EINTR) continue;
+        return -1;
+      } else if (n_chars == 0) {
+        errno = EPIPE;
+        return -1;
+      }
+      reader->start = 0;
+      reader->end = n_chars;
+    }
+
+    part = reader->end - reader->start;
+    if (part > length) {
+      part = length;
+    }
+    memcpy(data, reader->buffer + reader->start, part);
+    reader->start += part;
+    data = (char*) data + part;
+    length -= part;
+  }
+
+  return 0;
+}
+
+/**
+ * Asks the daemon listening on socket_path for the directory at path
+ * @return: 0 on success, with reader ready for cache_next_entry()
+ *          -1 on error: no daemon, or it could not list the directory
+ */
+static inline int cache_query(cache_reader *reader, const char *socket_path,
+                              const char *path, int sorted) {
+  struct sockaddr_un address;
+  char request[PATH_MAX + 4];
+  int length;
+  int status;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, socket_path);
+
+  reader->start = 0;
+  reader->end = 0;
+  if ((reader->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    return -1;
+  }
+
+  length = snprintf(request, sizeof(request), "%c %s\n", sorted ? 's' : 'f',
+                    path);
+  if (connect(reader->fd, (struct sockaddr*) &address,
+              sizeof(address)) == -1 ||
+      write(reader->fd, request, length) != length ||
+      cache_read(reader, &status, sizeof(status)) == -1) {
+    close(reader->fd);
+    return -1;
+  }
+
+  if (status != 0) {
+    close(reader->fd);
+    errno = status;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Reads the next entry of the answer into the arena, and its stat
+ * @return: 1 if there is one, 0 at the end of the answer
+ *          -1 on error
+ */
+static inline int cache_next_entry(cache_reader *reader, dir_arena *arena,
+                                   struct stat *stat_buffer) {
+  unsigned short length;
+  dir_entry *entry;
+
+  if (cache_read(reader, &length, sizeof(length)) == -1) {
+    return -1;
+  } else if (length == 0) {
+    return 0;
+  }
+
+  if (cache_read(reader, stat_buffer, sizeof(struct stat)) == -1 ||
+      dir_arena_reserve(arena, 1, length + 1) == -1) {
+    return -1;
+  }
+
+  entry = &arena->entries[arena->count];
+  entry->inode = stat_buffer->st_ino;
+  entry->name_offset = arena->names_used;
+  entry->name_length = length;
+  entry->type = IFTODT(stat_buffer->st_mode);
+  if (cache_read(reader, arena->names + arena->names_used, length) == -1) {
+    return -1;
+  }
+  arena->names[arena->names_used + length] = '\0';
+  arena->names_used += length + 1;
+  arena->count++;
+
+  return 1;
+}
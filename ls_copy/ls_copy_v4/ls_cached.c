@@ -0,0 +1,667 @@
+// Chapter 3 File Systems and the File Hierarchy
+// ls_cached, a daemon that answers ls_copy_v4 -s from memory
+//
+// Scripts that list the same large directories every few seconds pay for
+// a full getdents64() and an fstatat() per entry each time, however little
+// changed. ls_cached keeps the entries of each directory it is asked
+// about, with their stat, and watches the directory with inotify: an event
+// on a name marks only that entry stale, or removes it, and a query
+// re-stats the stale entries alone. The cost of a query is then the size
+// of the answer plus what changed since the last one.
+// The watch is added before the directory is read, so a change made while
+// it is read still comes as an event. When the inotify queue overflows,
+// events were lost and every directory is read again at its next query;
+// so is a directory that was moved or deleted. The least recently asked
+// directory is dropped past -n directories.
+// A change inside a subdirectory changes its i-node, but comes as an event
+// of the subdirectory alone, so the entries that are directories are
+// stated again at each query. Two paths to the same directory, as after a
+// rename or through a bind mount, get the same watch from the kernel:
+// its events go to both, and it is removed with the last of them.
+// The protocol is in list_cache.h. Queries are answered one at a time,
+// and the inotify queue is read before each answer and whenever idle.
+// A client gets CLIENT_TIMEOUT seconds in all to send its query and read
+// the answer, so one that hangs, or trickles a byte at a time, cannot stop
+// the others: its socket does not block, and each wait for it is a poll()
+// for the time that is left. The answer is put together in memory first,
+// so no time is spent on the cache while the client waits.
+// usage: ls_cached [-n directories] socket
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dir_reader.h"
+#include "out_buffer.h"
+#include "list_cache.h"
+
+#define DEFAULT_CACHED_DIRS 64 // directories kept, and watched
+#define EVENT_BUFFER_SIZE (64 * 1024) // bytes of inotify events read at once
+#define CLIENT_TIMEOUT 2000 // milliseconds a client may keep the daemon
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | \
+                      IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | \
+                      IN_DONT_FOLLOW)
+
+typedef struct _cached_entry {
+  char *name; // NULL if the slot is empty, removed if deleted
+  struct stat stat_buffer;
+  int stale; // stat_buffer must be read again
+} cached_entry;
+
+typedef struct _cached_dir {
+  char *path;
+  int fd; // the directory, open
+  int wd; // its inotify watch, maybe shared; -1 once removed
+  cached_entry *entries; // open addressing on the name
+  size_t size; // slots, a power of 2
+  size_t count; // entries
+  size_t used; // slots that are not empty, deleted ones included
+  int rescan; // the entries must be read again from the directory
+  unsigned long last_query;
+} cached_dir;
+
+typedef struct _list_cache {
+  cached_dir **dirs;
+  int num_dirs;
+  int max_dirs;
+  int inotify_fd;
+  unsigned long clock; // counts the queries
+} list_cache;
+
+int serve(int listen_fd, list_cache *cache);
+void answer(int fd, list_cache *cache);
+int wait_client(int fd, short events, struct timespec *deadline);
+int read_events(list_cache *cache);
+void apply_event(cached_dir *dir, struct inotify_event *event);
+void release_watch(list_cache *cache, cached_dir *dir);
+cached_dir *find_dir(list_cache *cache, const char *path);
+cached_dir *add_dir(list_cache *cache, const char *path);
+void drop_dir(list_cache *cache, cached_dir *dir);
+int scan_dir(cached_dir *dir, dir_arena *arena);
+int refresh_entries(list_cache *cache, cached_dir *dir);
+cached_entry *find_entry(cached_dir *dir, const char *name, int insert);
+int mark_entry(cached_dir *dir, const char *name);
+void remove_entry(cached_dir *dir, const char *name);
+void send_entries(out_buffer *out, cached_dir *dir, int sorted);
+int compare_entries(const void *a, const void *b);
+
+// marks the slot of a deleted entry; the slots after it stay reachable
+static char removed[] = "";
+
+int main(int argc, char *argv[]) {
+  list_cache cache;
+  struct sockaddr_un address;
+  char *end_ptr;
+  int listen_fd;
+  int ch;
+
+  cache.max_dirs = DEFAULT_CACHED_DIRS;
+  opterr = 0;
+  while ((ch = getopt(argc, argv, ":n:")) != -1) {
+    if (ch == 'n') {
+      cache.max_dirs = (int) strtol(optarg, &end_ptr, 10);
+      if (*end_ptr == '\0' && cache.max_dirs > 0) continue;
+    }
+    fprintf(stderr, "usage: %s [-n directories] socket\n", argv[0]);
+    return 1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (optind != argc - 1 ||
+      strlen(argv[optind]) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "usage: %s [-n directories] socket\n", argv[0]);
+    return 1;
+  }
+  strcpy(address.sun_path, argv[optind]);
+
+  // a client that goes away must not kill the daemon
+  signal(SIGPIPE, SIG_IGN);
+
+  cache.dirs = calloc(cache.max_dirs, sizeof(cached_dir*));
+  cache.num_dirs = 0;
+  cache.clock = 0;
+  if (cache.dirs == NULL ||
+      (cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+    perror("inotify_init1");
+    return 1;
+  }
+
+  // the socket of a previous run is in the way
+  unlink(address.sun_path);
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+      bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) == -1 ||
+      listen(listen_fd, 16) == -1) {
+    perror(address.sun_path);
+    return 1;
+  }
+
+  return serve(listen_fd, &cache);
+}
+
+/**
+ * Waits for queries and for inotify events, and handles them, forever
+ * @return: 1 if poll() fails
+ */
+int serve(int listen_fd, list_cache *cache) {
+  struct pollfd fds[2];
+  int fd;
+
+  fds[0].fd = listen_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = cache->inotify_fd;
+  fds[1].events = POLLIN;
+
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return 1;
+    }
+
+    // reading the events as they come keeps the queue from overflowing
+    if ((fds[1].revents & POLLIN) && read_events(cache) == -1) {
+      perror("inotify");
+    }
+
+    if (fds[0].revents & POLLIN) {
+      if ((fd = accept4(listen_fd, NULL, NULL,
+                        SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
+        perror("accept");
+        continue;
+      }
+      answer(fd, cache);
+      close(fd);
+    }
+  }
+}
+
+/**
+ * Waits until the client on fd is ready for events, or the deadline
+ * @return: 1 if it is ready
+ *          0 if the deadline passed, -1 on error
+ */
+int wait_client(int fd, short events, struct timespec *deadline) {
+  struct pollfd client = { fd, events, 0 };
+  struct timespec now;
+  long left;
+  int ready;
+
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left = (deadline->tv_sec - now.tv_sec) * 1000 +
+           (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    if (left <= 0) {
+      return 0;
+    }
+  } while ((ready = poll(&client, 1, (int) left)) == -1 && errno == EINTR);
+
+  return ready;
+}
+
+/**
+ * Reads a query from the client on fd and sends it the entries; gives up
+ * on a client that has not done both within CLIENT_TIMEOUT milliseconds
+ */
+void answer(int fd, list_cache *cache) {
+  char request[PATH_MAX + 4];
+  struct timespec deadline;
+  size_t length = 0;
+  size_t done = 0;
+  ssize_t n_chars;
+  out_buffer out;
+  cached_dir *dir;
+  int status = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += CLIENT_TIMEOUT / 1000;
+  deadline.tv_nsec += (CLIENT_TIMEOUT % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  // the query is one line
+  while (length == 0 || request[length - 1] != '\n') {
+    n_chars = read(fd, request + length, sizeof(request) - 1 - length);
+    if (n_chars == -1 && (errno == EINTR ||
+                          (errno == EAGAIN &&
+                           wait_client(fd, POLLIN, &deadline) == 1))) {
+      continue;
+    }
+    if (n_chars <= 0 || length + n_chars == sizeof(request) - 1) {
+      return;
+    }
+    length += n_chars;
+  }
+  request[length - 1] = '\0';
+  if (length < 4 || request[1] != ' ' || request[2] != '/') {
+    return;
+  }
+
+  // everything that changed up to now is in the queue
+  if (read_events(cache) == -1) {
+    perror("inotify");
+  }
+
+  dir = find_dir(cache, request + 2);
+  if (dir == NULL && (dir = add_dir(cache, request + 2)) == NULL) {
+    status = errno;
+  } else if (refresh_entries(cache, dir) == -1) {
+      status = errno;
+      drop_dir(cache, dir);
+  } else {
+      dir->last_query = ++cache->clock;
+  }
+
+  // in memory, to be sent as fast as the client takes it
+  if (out_init(&out, -1) == -1) {
+    return;
+  }
+  out_bytes(&out, (char*) &status, sizeof(status));
+  if (status == 0) {
+    send_entries(&out, dir, request[0] == 's');
+  }
+
+  while (out.error == 0 && done < out.used) {
+    n_chars = write(fd, out.data + done, out.used - done);
+    if (n_chars >= 0) {
+      done += n_chars;
+    } else if (errno != EINTR && (errno != EAGAIN ||
+                                  wait_client(fd, POLLOUT, &deadline) != 1)) {
+        break;
+    }
+  }
+  out_free(&out);
+}
+
+/**
+ * Reads the inotify events that are queued and applies them to the
+ * directories they are about
+ * @return: 0 on success
+ *          -1 on error
+ */
+int read_events(list_cache *cache) {
+  char buffer[EVENT_BUFFER_SIZE]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *event;
+  ssize_t n_chars;
+  char *next;
+  int i;
+
+  while (1) {
+    n_chars = read(cache->inotify_fd, buffer, sizeof(buffer));
+    if (n_chars == -1) {
+      if (errno == EINTR) continue;
+      return (errno == EAGAIN) ? 0 : -1;
+    }
+
+    for (next = buffer; next < buffer + n_chars;
+         next += sizeof(struct inotify_event) + event->len) {
+      event = (struct inotify_event*) next;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        // events were lost: nothing cached can be trusted
+        for (i = 0; i < cache->num_dirs; i++) {
+          cache->dirs[i]->rescan = 1;
+        }
+        continue;
+      }
+
+      // none if the directory was dropped, several if they share it
+      for (i = 0; i < cache->num_dirs; i++) {
+        if (cache->dirs[i]->wd == event->wd) {
+          apply_event(cache->dirs[i], event);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Applies one inotify event of its watch to the directory
+ */
+void apply_event(cached_dir *dir, struct inotify_event *event) {
+  if (event->mask & IN_IGNORED) {
+    // the directory is gone, or its watch was removed
+    dir->wd = -1;
+    dir->rescan = 1;
+  } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+      dir->rescan = 1;
+  } else if (event->len == 0 || dir->rescan) {
+      return;
+  } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      remove_entry(dir, event->name);
+  } else if (mark_entry(dir, event->name) == -1) {
+      dir->rescan = 1;
+  }
+}
+
+/**
+ * Lets go of the watch of the directory, and removes it unless another
+ * directory shares it
+ */
+void release_watch(list_cache *cache, cached_dir *dir) {
+  int i;
+
+  if (dir->wd == -1) {
+    return;
+  }
+
+  for (i = 0; i < cache->num_dirs && (cache->dirs[i] == dir ||
+                                      cache->dirs[i]->wd != dir->wd); i++) {
+    ;
+  }
+  if (i == cache->num_dirs) {
+    inotify_rm_watch(cache->inotify_fd, dir->wd);
+  }
+  dir->wd = -1;
+}
+
+cached_dir *find_dir(list_cache *cache, const char *path) {
+  int i;
+
+  for (i = 0; i < cache->num_dirs; i++) {
+    if (strcmp(cache->dirs[i]->path, path) == 0) {
+      return cache->dirs[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Starts to cache the directory at path, in place of the least recently
+ * asked one if the cache is full. Its entries are read by the first
+ * refresh_entries().
+ * @return: the directory, or NULL on error
+ */
+cached_dir *add_dir(list_cache *cache, const char *path) {
+  cached_dir *dir;
+  int oldest = 0;
+  int i;
+
+  if (cache->num_dirs == cache->max_dirs) {
+    for (i = 1; i < cache->num_dirs; i++) {
+      if (cache->dirs[i]->last_query < cache->dirs[oldest]->last_query) {
+        oldest = i;
+      }
+    }
+    drop_dir(cache, cache->dirs[oldest]);
+  }
+
+  if ((dir = calloc(1, sizeof(cached_dir))) == NULL ||
+      (dir->path = strdup(path)) == NULL) {
+    free(dir);
+    return NULL;
+  }
+  dir->fd = -1;
+  dir->wd = -1;
+  dir->rescan = 1;
+  cache->dirs[cache->num_dirs++] = dir;
+
+  return dir;
+}
+
+/**
+ * Stops caching the directory and frees it
+ */
+void drop_dir(list_cache *cache, cached_dir *dir) {
+  size_t i;
+  int j;
+
+  release_watch(cache, dir);
+  if (dir->fd != -1) {
+    close(dir->fd);
+  }
+  for (i = 0; i < dir->size; i++) {
+    if (dir->entries[i].name != removed) {
+      free(dir->entries[i].name);
+    }
+  }
+  free(dir->entries);
+  free(dir->path);
+
+  for (j = 0; cache->dirs[j] != dir; j++) {
+    ;
+  }
+  cache->dirs[j] = cache->dirs[--cache->num_dirs];
+  free(dir);
+}
+
+/**
+ * Forgets the entries of the directory and reads them again, all stale
+ * @return: 0 on success
+ *          -1 on error
+ */
+int scan_dir(cached_dir *dir, dir_arena *arena) {
+  size_t i;
+
+  for (i = 0; i < dir->size; i++) {
+    if (dir->entries[i].name != removed) {
+      free(dir->entries[i].name);
+    }
+    dir->entries[i].name = NULL;
+  }
+  dir->count = 0;
+  dir->used = 0;
+
+  if (dir_read_all(arena, dir->fd) == -1) {
+    return -1;
+  }
+
+  for (i = 0; i < arena->count; i++) {
+    if (mark_entry(dir, dir_entry_name(arena, &arena->entries[i])) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Brings the entries of the directory up to date: reads it all again if
+ * needed, and stats the stale entries and the subdirectories
+ * @return: 0 on success
+ *          -1 on error
+ */
+int refresh_entries(list_cache *cache, cached_dir *dir) {
+  dir_arena arena;
+  cached_entry *entry;
+  int result;
+  size_t i;
+
+  if (dir->rescan) {
+    // the path may now be another directory: opened and watched again,
+    // before it is read
+    release_watch(cache, dir);
+    if (dir->fd != -1) {
+      close(dir->fd);
+    }
+    if ((dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+        == -1 ||
+        (dir->wd = inotify_add_watch(cache->inotify_fd, dir->path,
+                                     WATCH_EVENTS)) == -1) {
+      return -1;
+    }
+
+    if (dir_arena_init(&arena) == -1) {
+      return -1;
+    }
+    result = scan_dir(dir, &arena);
+    dir_arena_free(&arena);
+    if (result == -1) {
+      return -1;
+    }
+    dir->rescan = 0;
+  }
+
+  for (i = 0; i < dir->size; i++) {
+    entry = &dir->entries[i];
+    // the i-node of a subdirectory changes with no event of this watch
+    if (entry->name == NULL || entry->name == removed ||
+        (!entry->stale && !S_ISDIR(entry->stat_buffer.st_mode))) {
+      continue;
+    }
+
+    if (fstatat(dir->fd, entry->name, &entry->stat_buffer,
+                AT_SYMLINK_NOFOLLOW) == 0) {
+      entry->stale = 0;
+    } else if (errno == ENOENT) { // its event is still on the way
+        free(entry->name);
+        entry->name = removed;
+        dir->count--;
+    } else {
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Finds the slot of the entry with the name, or with insert, the slot
+ * where it goes
+ * @return: the slot, or NULL
+ */
+cached_entry *find_entry(cached_dir *dir, const char *name, int insert) {
+  cached_entry *entry;
+  cached_entry *free_slot = NULL;
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  const char *c;
+  size_t i;
+
+  if (dir->size == 0) {
+    return NULL;
+  }
+
+  for (c = name; *c != '\0'; c++) {
+    hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+  }
+
+  for (i = hash & (dir->size - 1); ; i = (i + 1) & (dir->size - 1)) {
+    entry = &dir->entries[i];
+    if (entry->name == NULL) {
+      return insert ? ((free_slot != NULL) ? free_slot : entry) : NULL;
+    } else if (entry->name == removed) {
+        if (free_slot == NULL) {
+          free_slot = entry;
+        }
+    } else if (strcmp(entry->name, name) == 0) {
+        return entry;
+    }
+  }
+}
+
+/**
+ * Adds the entry with the name if it is new, and marks it stale
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+int mark_entry(cached_dir *dir, const char *name) {
+  cached_entry *old_entries = dir->entries;
+  size_t old_size = dir->size;
+  cached_entry *entry;
+  size_t i;
+
+  // past half full, the slots of deleted entries are cleared, and the
+  // table doubles if most of the others are in use
+  if (2 * (dir->used + 1) > dir->size) {
+    if (dir->size == 0) {
+      dir->size = 64;
+    } else if (4 * (dir->count + 1) > dir->size) {
+        dir->size *= 2;
+    }
+    if ((dir->entries = calloc(dir->size, sizeof(cached_entry))) == NULL) {
+      dir->entries = old_entries;
+      dir->size = old_size;
+      return -1;
+    }
+
+    dir->used = dir->count;
+    for (i = 0; i < old_size; i++) {
+      if (old_entries[i].name != NULL && old_entries[i].name != removed) {
+        *find_entry(dir, old_entries[i].name, 1) = old_entries[i];
+      }
+    }
+    free(old_entries);
+  }
+
+  entry = find_entry(dir, name, 1);
+  if (entry->name == NULL || entry->name == removed) {
+    if (entry->name == NULL) {
+      dir->used++;
+    }
+    if ((entry->name = strdup(name)) == NULL) {
+      entry->name = removed;
+      return -1;
+    }
+    dir->count++;
+  }
+  entry->stale = 1;
+
+  return 0;
+}
+
+void remove_entry(cached_dir *dir, const char *name) {
+  cached_entry *entry = find_entry(dir, name, 0);
+
+  if (entry != NULL) {
+    free(entry->name);
+    entry->name = removed;
+    dir->count--;
+  }
+}
+
+/**
+ * Writes the entries of the directory to out, as list_cache.h describes
+ */
+void send_entries(out_buffer *out, cached_dir *dir, int sorted) {
+  cached_entry **entries = malloc(dir->count * sizeof(cached_entry*) + 1);
+  unsigned short length;
+  size_t count = 0;
+  size_t i;
+
+  if (entries == NULL) {
+    out->error = ENOMEM;
+    return;
+  }
+
+  for (i = 0; i < dir->size; i++) {
+    if (dir->entries[i].name != NULL && dir->entries[i].name != removed) {
+      entries[count++] = &dir->entries[i];
+    }
+  }
+  if (sorted) {
+    qsort(entries, count, sizeof(cached_entry*), compare_entries);
+  }
+
+  for (i = 0; i < count && out->error == 0; i++) {
+    length = (unsigned short) strlen(entries[i]->name);
+    out_bytes(out, (char*) &length, sizeof(length));
+    out_bytes(out, (char*) &entries[i]->stat_buffer,
+              sizeof(struct stat));
+    out_bytes(out, entries[i]->name, length);
+  }
+  length = 0;
+  out_bytes(out, (char*) &length, sizeof(length));
+
+  free(entries);
+}
+
+int compare_entries(const void *a, const void *b) {
+  return strcoll((*(cached_entry**) a)->name, (*(cached_entry**) b)->name);
+}
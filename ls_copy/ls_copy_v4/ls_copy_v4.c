@@ -0,0 +1,676 @@
+// Chapter 3 File Systems and the File Hierarchy
+// version 4, an ls for very large directories, built on version 3:
+// the directory is read with getdents64() in large batches into an arena
+// (dir_reader.h) instead of one readdir() call per entry, and the files
+// are looked up relative to the open directory. The long listing stats
+// the entries with a pool of threads (stat_pool.h), so link with -pthread.
+// The lines are put together in a buffer and written out in large
+// write() calls (out_buffer.h) instead of with printf().
+// -R lists the subdirectories too, in parallel (tree_walk.h), with the
+// output in the order of a serial walk.
+// The entries are sorted by name, spilling sorted runs to temporary files
+// past a memory budget (dir_sort.h); -f lists them unsorted, in the order
+// of the directory, each batch as soon as it is read, in constant memory.
+// -s asks the daemon ls_cached for the entries and their stat instead,
+// and reads the directory itself only if the daemon cannot answer.
+// On a terminal, or with -C, the names are laid out in columns that fit
+// the width of the terminal (grid_layout.h); -1 prints one per line.
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dir_reader.h"
+#include "stat_pool.h"
+#include "id_cache.h"
+#include "date_cache.h"
+#include "out_buffer.h"
+#include "tree_walk.h"
+#include "key_sort.h"
+#include "dir_sort.h"
+#include "list_cache.h"
+#include "grid_layout.h"
+
+#define DEFAULT_LINE_WIDTH 80 // columns of output that is not a terminal
+#define MAX_THREADS 1024 // -j, more would only pile up on the server
+
+typedef struct _ls_options {
+  int long_listing; // -l
+  int num_threads; // -j, fstatat() calls in flight for -l
+  int preload_ids; // -P, read all user and group names at the start
+  int recursive; // -R, list the subdirectories too
+  int unsorted; // -f, list in the order of the directory, as it is read
+  size_t sort_budget; // -M, bytes of entries held in memory to sort them
+  char *cache_socket; // -s, the socket of ls_cached, NULL to read directly
+  int columns; // -C, or output to a terminal: names in columns; -1 not
+  int line_width; // characters the columns fit in
+} ls_options;
+
+void ls(char dir_name[], dir_arena *arena, ls_options *options);
+void list_directory(walk_worker *worker, walk_task *task, void *arg);
+void add_subdirectories(walk_worker *worker, walk_task *task,
+                        dir_arena *arena);
+void list_entries(out_buffer *out, date_cache *dates, dir_arena *arena,
+                  int dir_fd, ls_options *options, int stat_threads);
+int list_cached(char dir_name[], dir_arena *arena, int dir_fd,
+                ls_options *options);
+void list_names(out_buffer *out, dir_arena *arena, ls_options *options);
+void list_columns(out_buffer *out, dir_arena *arena, int line_width);
+int get_line_width(int fd);
+void print_file_status(out_buffer *out, date_cache *dates, int dir_fd,
+                       char *file_name, struct stat *stat_buffer);
+void mode_to_string(int mode, char str[]);
+char* uid_to_name(uid_t uid);
+char* gid_to_name(gid_t gid);
+char* get_date_no_day(date_cache *cache, time_t time_eval);
+size_t parse_size(char *string);
+int parse_count(char *string, char *what, int max);
+
+// the names of the owners of the files, looked up once per id;
+// the threads of -R share them under the lock
+static id_cache users;
+static id_cache groups;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the days of the modification times, formatted once per day
+static date_cache dates;
+
+// standard output, buffered
+static out_buffer output;
+
+int main(int argc, char *argv[]) {
+  ls_options options;
+  dir_arena arena;
+  int ch;
+  char short_options[] = ":1Cfj:lM:PRs:";
+
+  options.long_listing = 0;
+  options.num_threads = DEFAULT_STAT_THREADS;
+  options.preload_ids = 0;
+  options.recursive = 0;
+  options.unsorted = 0;
+  options.sort_budget = DEFAULT_SORT_BUDGET;
+  options.cache_socket = NULL;
+  options.columns = isatty(1);
+  options.line_width = DEFAULT_LINE_WIDTH;
+
+  opterr = 0; // turn off error messages by getopt()
+
+  while (1) {
+    ch = getopt(argc, argv, short_options);
+
+    // it return -1 when it finds no more options
+    if (ch == -1) break;
+
+    switch (ch) {
+      case '1':
+        options.columns = 0;
+        break;
+      case 'C':
+        options.columns = 1;
+        break;
+      case 'f':
+        options.unsorted = 1;
+        break;
+      case 'j':
+        options.num_threads = parse_count(optarg, "threads", MAX_THREADS);
+        break;
+      case 'l':
+        options.long_listing = 1;
+        break;
+      case 'M':
+        options.sort_budget = parse_size(optarg);
+        break;
+      case 'P':
+        options.preload_ids = 1;
+        break;
+      case 'R':
+        options.recursive = 1;
+        break;
+      case 's':
+        options.cache_socket = optarg;
+        break;
+      case '?':
+        printf("Illegal option ignored.\n");
+        break;
+      default:
+        printf("getopt returned characted code 0%o ??\n", ch);
+        break;
+    }
+  }
+
+  // the complaints of getopt() come before the listing
+  fflush(stdout);
+
+  if (options.columns) {
+    options.line_width = get_line_width(1);
+  }
+
+  if (dir_arena_init(&arena) == -1 || id_cache_init(&users, 0) == -1 ||
+      id_cache_init(&groups, 1) == -1 || out_init(&output, 1) == -1) {
+    perror("init");
+    return 1;
+  }
+
+  date_cache_init(&dates);
+
+  if (options.preload_ids && options.long_listing) {
+    id_cache_preload(&users);
+    id_cache_preload(&groups);
+  }
+
+  if (optind == argc) { // no arguments; use .
+    ls(".", &arena, &options);
+  } else {
+      while (optind < argc) {
+        ls(argv[optind], &arena, &options);
+        optind++;
+      }
+  }
+
+  if (out_flush(&output) == -1) {
+    errno = output.error;
+    perror("write");
+  }
+
+  dir_arena_free(&arena);
+  id_cache_free(&users);
+  id_cache_free(&groups);
+  out_free(&output);
+  return (output.error == 0) ? 0 : 1;
+}
+
+void ls(char dir_name[], dir_arena *arena, ls_options *options) {
+  struct stat stat_buffer; // to store stat results
+  dir_sort sort;
+  long n;
+  int dir_fd;
+
+  // test if a regular file, and if so, just display it
+  if (lstat(dir_name, &stat_buffer) == -1) {
+    perror(dir_name);
+    return; // stat call failed so we quit
+  } else if (!S_ISDIR(stat_buffer.st_mode)) {
+      if (options->long_listing) {
+        print_file_status(&output, &dates, AT_FDCWD, dir_name, &stat_buffer);
+      } else {
+          out_string(&output, dir_name);
+          out_char(&output, '\n');
+      }
+      return;
+  }
+
+  if ((dir_fd = open(dir_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "Cannot open %s\n", dir_name);
+    return;
+  }
+
+  // the walk lists the directory, then what is under it, and closes it
+  if (options->recursive) {
+    if (walk_tree(dir_name, dir_fd, options->num_threads, list_directory,
+                  options, &dates, &output) == -1) {
+      perror(dir_name);
+    }
+    return;
+  }
+
+  out_char(&output, '\n');
+  out_string(&output, dir_name);
+  out_bytes(&output, ":\n", 2);
+
+  // a directory that fails half way is listed as far as it was read
+  dir_arena_reset(arena);
+  if (options->cache_socket != NULL &&
+      list_cached(dir_name, arena, dir_fd, options) == 0) {
+    close(dir_fd);
+    return;
+  }
+
+  if (options->unsorted) {
+    // one batch of getdents64() at a time: the memory does not grow
+    while ((n = dir_read_batch(arena, dir_fd)) > 0) {
+      list_entries(&output, &dates, arena, dir_fd, options,
+                   options->num_threads);
+      dir_arena_reset(arena);
+    }
+    if (n == -1) {
+      perror(dir_name);
+    }
+    close(dir_fd);
+    return;
+  }
+
+  dir_sort_init(&sort, options->sort_budget);
+  if (dir_read_sorted(&sort, arena, dir_fd) == -1) {
+    perror(dir_name);
+  }
+
+  if (sort.num_runs == 0) { // it all fit in memory
+    list_entries(&output, &dates, arena, dir_fd, options,
+                 options->num_threads);
+  } else if (dir_sort_merge(&sort) == -1) {
+      perror(dir_name);
+  } else {
+      while ((n = dir_sort_next_batch(&sort, arena)) > 0) {
+        list_entries(&output, &dates, arena, dir_fd, options,
+                     options->num_threads);
+      }
+      if (n == -1) {
+        perror(dir_name);
+      }
+  }
+
+  dir_sort_free(&sort);
+  close(dir_fd);
+}
+
+/**
+ * Lists one directory of -R, in a thread of the walk: as ls() does, into
+ * the thread's buffer, and then hands the subdirectories to the walk.
+ * Each thread of the walk already keeps one fstatat() in flight, so the
+ * entries are stated without more threads. The directory is sorted in
+ * memory, without a budget.
+ */
+void list_directory(walk_worker *worker, walk_task *task, void *arg) {
+  ls_options *options = (ls_options*) arg;
+  dir_arena *arena = &worker->arena;
+  long n;
+
+  out_char(&worker->out, '\n');
+  out_string(&worker->out, task->path);
+  out_bytes(&worker->out, ":\n", 2);
+
+  dir_arena_reset(arena);
+  if (options->unsorted) {
+    while ((n = dir_read_batch(arena, task->fd)) > 0) {
+      list_entries(&worker->out, &worker->dates, arena, task->fd, options, 1);
+      add_subdirectories(worker, task, arena);
+      dir_arena_reset(arena);
+    }
+    if (n == -1) {
+      perror(task->path);
+    }
+    return;
+  }
+
+  if (dir_read_all(arena, task->fd) == -1 || dir_arena_sort(arena) == -1) {
+    perror(task->path);
+  }
+
+  list_entries(&worker->out, &worker->dates, arena, task->fd, options, 1);
+  add_subdirectories(worker, task, arena);
+}
+
+/**
+ * Hands the subdirectories among the entries of the arena to the walk,
+ * in order; symbolic links to directories are not followed
+ */
+void add_subdirectories(walk_worker *worker, walk_task *task,
+                        dir_arena *arena) {
+  struct stat stat_buffer;
+  dir_entry *entry;
+  char *name;
+  int is_dir;
+  size_t i;
+
+  for (i = 0; i < arena->count; i++) {
+    entry = &arena->entries[i];
+    name = dir_entry_name(arena, entry);
+    is_dir = (entry->type == DT_DIR);
+    if (entry->type == DT_UNKNOWN) { // not every file system fills it in
+      is_dir = (fstatat(task->fd, name, &stat_buffer,
+                        AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISDIR(stat_buffer.st_mode));
+    }
+
+    if (is_dir && walk_add_child(worker, task, name) == -1) {
+      perror(task->path);
+      break;
+    }
+  }
+}
+
+/**
+ * Prints the entries of the arena, in the order of the directory.
+ * For a long listing they are stated a window at a time by the pool.
+ */
+void list_entries(out_buffer *out, date_cache *dates, dir_arena *arena,
+                  int dir_fd, ls_options *options, int stat_threads) {
+  stat_job job;
+  char *name;
+  size_t first;
+  size_t count;
+  size_t i;
+
+  if (!options->long_listing) {
+    list_names(out, arena, options);
+    return;
+  }
+
+  count = (arena->count < STAT_WINDOW) ? arena->count : STAT_WINDOW;
+  job.dir_fd = dir_fd;
+  job.arena = arena;
+  job.stats = malloc(count * sizeof(struct stat));
+  job.errors = malloc(count * sizeof(int));
+  if (job.stats == NULL || job.errors == NULL) {
+    perror("list_entries");
+    free(job.stats);
+    free(job.errors);
+    return;
+  }
+
+  for (first = 0; first < arena->count; first += count) {
+    if (arena->count - first < count) {
+      count = arena->count - first;
+    }
+    stat_window(&job, first, count, stat_threads);
+
+    for (i = 0; i < count; i++) {
+      name = dir_entry_name(arena, &arena->entries[first + i]);
+      if (job.errors[i] != 0) {
+        // stat call failed but we go on
+        fprintf(stderr, "%s: %s\n", name, strerror(job.errors[i]));
+        continue;
+      }
+      print_file_status(out, dates, dir_fd, name, &job.stats[i]);
+    }
+  }
+
+  free(job.stats);
+  free(job.errors);
+}
+
+/**
+ * Lists the directory with the entries and the stat that ls_cached keeps,
+ * a window at a time; dir_fd is only used to read symbolic links
+ * @return: 0 once listed, even in part
+ *          -1 if the daemon could not answer, and nothing was listed
+ */
+int list_cached(char dir_name[], dir_arena *arena, int dir_fd,
+                ls_options *options) {
+  cache_reader *reader = malloc(sizeof(cache_reader));
+  struct stat *stats = malloc(STAT_WINDOW * sizeof(struct stat));
+  char path[PATH_MAX];
+  char *name;
+  int result = -1;
+  int n = 1;
+  size_t i;
+
+  if (reader != NULL && stats != NULL && realpath(dir_name, path) != NULL &&
+      cache_query(reader, options->cache_socket, path,
+                  !options->unsorted) == 0) {
+    result = 0;
+    while (n == 1) {
+      dir_arena_reset(arena);
+      while (arena->count < STAT_WINDOW &&
+             (n = cache_next_entry(reader, arena,
+                                   &stats[arena->count])) == 1) {
+        ;
+      }
+
+      if (!options->long_listing) {
+        list_names(&output, arena, options);
+      }
+      for (i = 0; options->long_listing && i < arena->count; i++) {
+        name = dir_entry_name(arena, &arena->entries[i]);
+        print_file_status(&output, &dates, dir_fd, name, &stats[i]);
+      }
+    }
+    if (n == -1) {
+      perror(dir_name);
+    }
+    close(reader->fd);
+  }
+
+  free(reader);
+  free(stats);
+  return result;
+}
+
+/**
+ * Prints the names of the arena, in columns or one per line. A directory
+ * read in batches, with -f or past the sort budget, is laid out one batch
+ * at a time.
+ */
+void list_names(out_buffer *out, dir_arena *arena, ls_options *options) {
+  size_t i;
+
+  if (options->columns) {
+    list_columns(out, arena, options->line_width);
+    return;
+  }
+
+  for (i = 0; i < arena->count; i++) {
+    out_bytes(out, dir_entry_name(arena, &arena->entries[i]),
+              arena->entries[i].name_length);
+    out_char(out, '\n');
+  }
+}
+
+/**
+ * Prints the names of the arena down the columns, as many columns as fit
+ * in line_width, or one per line if out of memory
+ */
+void list_columns(out_buffer *out, dir_arena *arena, int line_width) {
+  unsigned short *widths = malloc(arena->count * sizeof(unsigned short) + 1);
+  unsigned short *column_widths = malloc((line_width / MIN_COLUMN_WIDTH + 1)
+                                         * sizeof(unsigned short));
+  dir_entry *entry;
+  int columns = -1;
+  size_t rows = arena->count;
+  size_t row;
+  size_t i;
+
+  if (widths != NULL && column_widths != NULL) {
+    for (i = 0; i < arena->count; i++) {
+      widths[i] = arena->entries[i].name_length;
+    }
+    columns = grid_layout(widths, arena->count, line_width, column_widths,
+                          &rows);
+  }
+  if (columns == -1) {
+    columns = 1;
+    rows = arena->count;
+  }
+
+  for (row = 0; row < rows; row++) {
+    // the name in column j is entry row + j * rows; the last of a line
+    // is not padded
+    for (i = row; i < arena->count; i += rows) {
+      entry = &arena->entries[i];
+      if (i + rows < arena->count) {
+        out_field(out, dir_entry_name(arena, entry),
+                  column_widths[i / rows] + 2);
+      } else {
+          out_bytes(out, dir_entry_name(arena, entry), entry->name_length);
+      }
+    }
+    out_char(out, '\n');
+  }
+
+  free(widths);
+  free(column_widths);
+}
+
+void print_file_status(out_buffer *out, date_cache *dates, int dir_fd,
+                       char *file_name, struct stat *stat_buffer) {
+  ssize_t count;
+  char buffer[PATH_MAX];
+  char *date;
+
+  // print out type, permission, and number of links
+  mode_to_string(stat_buffer->st_mode, out_reserve(out, 10));
+  out_commit(out, 10);
+  out_number(out, stat_buffer->st_nlink, 3);
+
+  // print out owner's name if it is found using getpwuid()
+  out_char(out, ' ');
+  out_field(out, uid_to_name(stat_buffer->st_uid), 8);
+
+  // print out group name if it is found using getgrgid()
+  out_char(out, ' ');
+  out_field(out, gid_to_name(stat_buffer->st_gid), 8);
+
+  // print size of file
+  out_char(out, ' ');
+  out_number(out, stat_buffer->st_size, 8);
+
+  // print time of last modification, at most 12 characters
+  date = get_date_no_day(dates, stat_buffer->st_mtime);
+  out_char(out, ' ');
+  out_bytes(out, date, strnlen(date, 12));
+
+  // print file name and if a link, the linked file
+  out_bytes(out, "  ", 2);
+  out_string(out, file_name);
+
+  if (S_ISLNK(stat_buffer->st_mode)) {
+    if ((count = readlinkat(dir_fd, file_name, buffer,
+                            sizeof(buffer) - 1)) == -1) {
+      perror("print_file_status: ");
+    } else {
+        out_bytes(out, "->", 2);
+        out_bytes(out, buffer, count);
+    }
+  }
+  out_char(out, '\n');
+}
+
+/**
+ * Writes the 10 characters of type and permissions of mode to str
+ */
+void mode_to_string(int mode, char str[]) {
+  memcpy(str, "----------", 10); // default, no permissions
+
+  if (S_ISDIR(mode)) str[0] = 'd'; // directory
+  else if (S_ISCHR(mode)) str[0] = 'c'; // char device
+  else if (S_ISBLK(mode)) str[0] = 'b'; // block device
+  else if (S_ISLNK(mode)) str[0] = 'l'; // symbolic link
+  else if (S_ISFIFO(mode)) str[0] = 'p'; // named pipe (FIFO)
+  else if (S_ISSOCK(mode)) str[0] = 's'; // socket
+
+  if (mode & S_IRUSR) str[1] = 'r'; // 3 bits for user
+  if (mode & S_IWUSR) str[2] = 'w';
+  if (mode & S_IXUSR) str[3] = 'x';
+
+  if (mode & S_IRGRP) str[4] = 'r'; // 3 bits for group
+  if (mode & S_IWGRP) str[5] = 'w';
+  if (mode & S_IXGRP) str[6] = 'x';
+
+  if (mode & S_IROTH) str[7] = 'r'; // 3 bits for other
+  if (mode & S_IWOTH) str[8] = 'w';
+  if (mode & S_IXOTH) str[9] = 'x';
+
+  if (mode & S_ISUID) str[3] = 's'; // get uid
+  if (mode & S_ISGID) str[6] = 's'; // set gid
+  if (mode & S_ISVTX) str[9] = 't'; // sticky bit
+}
+
+/**
+ * Given user-id, return user-name if possible
+ */
+char* uid_to_name(uid_t uid) {
+  char *name;
+
+  pthread_mutex_lock(&names_lock);
+  name = id_cache_name(&users, uid);
+  pthread_mutex_unlock(&names_lock);
+
+  return name;
+}
+
+/**
+ * Given group-id, return group-name if possible
+ */
+char* gid_to_name(gid_t gid) {
+  char *name;
+
+  pthread_mutex_lock(&names_lock);
+  name = id_cache_name(&groups, gid);
+  pthread_mutex_unlock(&names_lock);
+
+  return name;
+}
+
+/**
+ * Format the time of the file depending
+ * if the file is less than 6 months "%b %e %H:%M"
+ * else "%b %e %Y"
+ */
+char* get_date_no_day(date_cache *cache, time_t time_eval) {
+  return date_cache_format(cache, time_eval);
+}
+
+/**
+ * The width of the terminal on fd, as more_copy finds it, or else
+ * $COLUMNS, or else DEFAULT_LINE_WIDTH
+ */
+int get_line_width(int fd) {
+  struct winsize window_arg;
+  char *columns;
+  int width;
+
+  if (ioctl(fd, TIOCGWINSZ, &window_arg) == 0 && window_arg.ws_col > 0) {
+    return window_arg.ws_col;
+  }
+
+  if ((columns = getenv("COLUMNS")) != NULL &&
+      (width = atoi(columns)) > 0) {
+    return width;
+  }
+
+  return DEFAULT_LINE_WIDTH;
+}
+
+size_t parse_size(char *string) {
+  char *end_ptr;
+  unsigned long long size;
+
+  errno = 0;
+  size = strtoull(string, &end_ptr, 0);
+
+  switch (*end_ptr) {
+    case 'k': case 'K': size <<= 10; end_ptr++; break;
+    case 'm': case 'M': size <<= 20; end_ptr++; break;
+    case 'g': case 'G': size <<= 30; end_ptr++; break;
+  }
+
+  if (errno != 0 || size == 0 || *end_ptr != '\0') {
+    fprintf(stderr, "usage: size must be a positive number: %s\n", string);
+    exit(1);
+  }
+
+  return (size_t) size;
+}
+
+/**
+ * Converts a count such as the number of threads, which must be from 1 to
+ * max
+ */
+int parse_count(char *string, char *what, int max) {
+  char *end_ptr;
+  long count;
+
+  errno = 0;
+  count = strtol(string, &end_ptr, 10);
+
+  if (errno != 0 || *end_ptr != '\0' || count < 1 || count > max) {
+    fprintf(stderr, "usage: %s must be from 1 to %d: %s\n", what, max,
+            string);
+    exit(1);
+  }
+
+  return (int) count;
+}
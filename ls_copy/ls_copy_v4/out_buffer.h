@@ -0,0 +1,173 @@
+// Chapter 3 File Systems and the File Hierarchy
+// buffered output of a listing, used by ls_copy_v4
+//
+// printf() parses its format and locks stdout on every call, and a long
+// listing made eight calls per line. Here each line is put together in one
+// large buffer with plain copies and a hand-made conversion of numbers,
+// and the buffer goes out with write() once it is full (or at the end):
+// a listing into a pipe costs one system call per OUT_BUFFER_SIZE bytes.
+// After the first failed write() the rest of the output is dropped and
+// the error kept for the caller.
+// A buffer opened on fd -1 is never written out: it grows instead, to
+// hold a whole listing in memory until it can be written in its turn.
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OUT_BUFFER_SIZE (256 * 1024) // bytes gathered before a write()
+
+typedef struct _out_buffer {
+  int fd; // -1 to keep everything in memory
+  char *data;
+  size_t used;
+  size_t size;
+  int error; // errno of the first failed write(), 0 if none
+} out_buffer;
+
+/**
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int out_init(out_buffer *out, int fd) {
+  out->fd = fd;
+  out->used = 0;
+  out->size = OUT_BUFFER_SIZE;
+  out->error = 0;
+  if ((out->data = malloc(OUT_BUFFER_SIZE)) == NULL) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Writes out what the buffer holds
+ * @return: 0 on success
+ *          -1 on error, now or before
+ */
+static inline int out_flush(out_buffer *out) {
+  size_t done = 0;
+  ssize_t n_chars;
+
+  while (out->fd != -1 && done < out->used && out->error == 0) {
+    n_chars = write(out->fd, out->data + done, out->used - done);
+    if (n_chars == -1) {
+      if (errno == EINTR) continue;
+      out->error = errno;
+    } else {
+        done += n_chars;
+    }
+  }
+  out->used = 0;
+
+  return (out->error == 0) ? 0 : -1;
+}
+
+static inline void out_free(out_buffer *out) {
+  free(out->data);
+  out->data = NULL;
+}
+
+/**
+ * Room for length more bytes, which must be at most OUT_BUFFER_SIZE.
+ * A buffer in memory that cannot grow is emptied, and the error kept.
+ * @return: where to put them; the caller then calls out_commit()
+ */
+static inline char *out_reserve(out_buffer *out, size_t length) {
+  size_t size = out->size;
+  char *grown;
+
+  if (out->used + length <= out->size) {
+    return out->data + out->used;
+  }
+
+  if (out->fd != -1) {
+    out_flush(out);
+  } else {
+      while (out->used + length > size) {
+        size *= 2;
+      }
+      if ((grown = realloc(out->data, size)) == NULL) {
+        out->error = ENOMEM;
+        out->used = 0;
+      } else {
+          out->data = grown;
+          out->size = size;
+      }
+  }
+
+  return out->data + out->used;
+}
+
+/**
+ * Adds to the buffer the length bytes put where out_reserve() said
+ */
+static inline void out_commit(out_buffer *out, size_t length) {
+  out->used += length;
+}
+
+static inline void out_bytes(out_buffer *out, const char *data,
+                             size_t length) {
+  size_t part;
+
+  while (length > 0) {
+    part = (length < OUT_BUFFER_SIZE) ? length : OUT_BUFFER_SIZE;
+    memcpy(out_reserve(out, part), data, part);
+    out_commit(out, part);
+    data += part;
+    length -= part;
+  }
+}
+
+static inline void out_string(out_buffer *out, const char *string) {
+  out_bytes(out, string, strlen(string));
+}
+
+static inline void out_char(out_buffer *out, char c) {
+  *out_reserve(out, 1) = c;
+  out_commit(out, 1);
+}
+
+/**
+ * A string cut or padded with spaces to width, as printf("%-8.8s")
+ */
+static inline void out_field(out_buffer *out, const char *string,
+                             size_t width) {
+  char *to = out_reserve(out, width);
+  size_t i;
+
+  for (i = 0; i < width && string[i] != '\0'; i++) {
+    to[i] = string[i];
+  }
+  memset(to + i, ' ', width - i);
+  out_commit(out, width);
+}
+
+/**
+ * A number right-justified in at least width characters, as printf("%8jd")
+ */
+static inline void out_number(out_buffer *out, long long value, int width) {
+  char digits[24];
+  unsigned long long magnitude = (value < 0) ? 0 - (unsigned long long) value
+                                             : (unsigned long long) value;
+  int length = 0;
+  char *to;
+
+  do {
+    digits[sizeof(digits) - 1 - length++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+
+  if (value < 0) {
+    digits[sizeof(digits) - 1 - length++] = '-';
+  }
+
+  if (width < length) {
+    width = length;
+  }
+  to = out_reserve(out, width);
+  memset(to, ' ', width - length);
+  memcpy(to + width - length, digits + sizeof(digits) - length, length);
+  out_commit(out, width);
+}
@@ -0,0 +1,113 @@
+// Chapter 3 File Systems and the File Hierarchy
+// stat of many entries at once, used by the long listing of ls_copy_v4
+//
+// ls -l needs the i-node of every entry, one fstatat() each. On a local
+// disk with the i-nodes cached that is cheap, but on NFS and other network
+// file systems each call waits for a round trip to the server, and a
+// listing spends nearly all of its time waiting. A pool of threads issues
+// the calls at the same time: each thread takes the next chunk of entries
+// not yet taken, and writes each result at the index of its entry, so the
+// listing comes out in the same order whatever thread ends first. A chunk
+// is the entries shared out evenly between the threads, from
+// MIN_STAT_CHUNK, so that a directory of a few dozen entries still has its
+// round trips overlap, up to STAT_CHUNK, so that the threads of a large
+// window still balance their work.
+// The entries are done a window of STAT_WINDOW at a time, which bounds
+// the memory of the results and lets the first lines out early.
+// fstatat() works on every kernel and file system; io_uring's statx would
+// save the threads, but not the round trips.
+// Requires dir_reader.h.
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#define DEFAULT_STAT_THREADS 8 // fstatat() calls in flight
+#define STAT_CHUNK 64 // most entries a thread takes at a time
+#define MIN_STAT_CHUNK 4 // fewest entries worth a thread
+#define STAT_WINDOW (16 * 1024) // entries stated before they are printed
+
+typedef struct _stat_job {
+  int dir_fd; // the names are looked up in this directory
+  dir_arena *arena;
+  size_t first; // first entry of the window
+  size_t count; // entries in the window
+  size_t next; // first entry of the window not yet taken
+  size_t chunk; // entries a thread takes at a time
+  struct stat *stats; // stats[i] is the result for entry first + i
+  int *errors; // errno of its fstatat(), 0 on success
+} stat_job;
+
+/**
+ * Thread routine, also run by the calling thread: stats chunks of the
+ * window until there are none left
+ */
+static void *stat_chunks(void *data) {
+  stat_job *job = (stat_job*) data;
+  size_t start;
+  size_t end;
+  size_t i;
+  char *name;
+
+  while ((start = __atomic_fetch_add(&job->next, job->chunk,
+                                     __ATOMIC_RELAXED)) < job->count) {
+    end = (start + job->chunk < job->count) ? start + job->chunk
+                                            : job->count;
+
+    for (i = start; i < end; i++) {
+      name = dir_entry_name(job->arena, &job->arena->entries[job->first + i]);
+      job->errors[i] = 0;
+      if (fstatat(job->dir_fd, name, &job->stats[i],
+                  AT_SYMLINK_NOFOLLOW) == -1) {
+        job->errors[i] = errno;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Stats count entries of the arena from first on, with up to num_threads
+ * threads; a window too small to share is done by the calling thread alone.
+ * If threads cannot be created, those that could and the calling thread
+ * do the work.
+ */
+static inline void stat_window(stat_job *job, size_t first, size_t count,
+                               int num_threads) {
+  pthread_t *threads = NULL;
+  int started = 0;
+  int i;
+
+  job->first = first;
+  job->count = count;
+  job->next = 0;
+  job->chunk = (num_threads > 1) ? count / num_threads : count;
+  if (job->chunk < MIN_STAT_CHUNK) {
+    job->chunk = MIN_STAT_CHUNK;
+  } else if (job->chunk > STAT_CHUNK) {
+      job->chunk = STAT_CHUNK;
+  }
+
+  // no more threads than chunks
+  if ((size_t) num_threads > (count + job->chunk - 1) / job->chunk) {
+    num_threads = (int) ((count + job->chunk - 1) / job->chunk);
+  }
+
+  if (num_threads > 1 &&
+      (threads = calloc(num_threads - 1, sizeof(pthread_t))) != NULL) {
+    for (started = 0; started < num_threads - 1; started++) {
+      if (pthread_create(&threads[started], NULL, stat_chunks, job) != 0) {
+        break;
+      }
+    }
+  }
+
+  stat_chunks(job);
+
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+}
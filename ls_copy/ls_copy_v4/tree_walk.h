@@ -0,0 +1,568 @@
+// Chapter 3 File Systems and the File Hierarchy
+// recursive listing with a pool of threads, used by ls_copy_v4 -R
+//
+// ls -R lists a directory, then each of its subdirectories in the order
+// they were listed, and so on down: a depth-first walk whose output order
+// is fixed. Here the directories are listed by a pool of threads. A
+// thread holds the directory it lists open and opens the subdirectories
+// it finds with openat() relative to it, so no path is looked up from the
+// top again. Each directory is a task:
+//   - a thread pushes the subdirectories it finds on its own deque and
+//     takes its next task from that same end, depth first, close to what
+//     it just read;
+//   - a thread with nothing left steals from the other end of another
+//     thread's deque, where the tasks nearest the top, and so the largest
+//     subtrees, wait. One deep or wide subtree is thus shared out.
+// The listing of each task is rendered into memory. The calling thread is
+// the reorder buffer: it goes through the tree of tasks in the order a
+// serial ls would, waits for each task to be done and writes its listing
+// out, so the output is the same whatever the number of threads.
+// At most WALK_OPEN_FDS subdirectories wait open in the deques; past that
+// they are opened by path when their turn comes.
+// The listings done but not yet written are held in memory. Past
+// WALK_MAX_HELD of them, the threads take no more tasks but the one the
+// calling thread waits for, which it names in wanted: they pick it out of
+// whatever deque it is in. The threads can thus run ahead of the output by
+// a bounded number of directories, however slow one of them is.
+// Requires dir_reader.h, date_cache.h and out_buffer.h.
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WALK_OPEN_FDS 256 // subdirectories kept open while they wait
+#define WALK_DEQUE 64 // tasks a deque starts with, a power of 2
+#define WALK_MAX_HELD 1024 // listings done, not yet written, before a wait
+
+typedef struct _walk_task {
+  char *path; // as it is printed
+  int fd; // the directory, -1 until it is opened
+  struct _walk_task **children; // subdirectories, in the order listed
+  size_t num_children;
+  size_t children_capacity;
+  char *listing; // rendered by a thread, written by the caller
+  size_t listing_length;
+  int done; // set with the lock of the walk held
+} walk_task;
+
+typedef struct _task_deque {
+  walk_task **tasks; // a ring
+  size_t head; // the oldest task, stolen from here
+  size_t count;
+  size_t capacity; // a power of 2
+  pthread_mutex_t lock;
+} task_deque;
+
+typedef struct _walk_worker {
+  pthread_t thread;
+  struct _walk *walk;
+  task_deque deque;
+  dir_arena arena;
+  date_cache dates;
+  out_buffer out; // in memory
+  unsigned seed; // picks whom to steal from
+} walk_worker;
+
+// lists task->fd into worker->out, and calls walk_add_child() for each
+// subdirectory, in the order they are listed
+typedef void (*walk_lister)(walk_worker *worker, walk_task *task, void *arg);
+
+typedef struct _walk {
+  walk_worker *workers;
+  int num_workers;
+  walk_lister lister;
+  void *arg;
+  long pending; // tasks not done yet
+  long queued; // tasks in the deques
+  long idle; // threads waiting for a task
+  long open_fds; // tasks waiting with their directory open
+  long held; // tasks done whose listing is not written yet
+  long max_held; // held past which only the wanted task is taken
+  walk_task *wanted; // the task the output waits for, if not done
+  pthread_mutex_t lock;
+  pthread_cond_t work; // a task was queued, or every task is done
+  pthread_cond_t done; // a task is done
+} walk;
+
+/**
+ * @return: a task for path, or NULL if out of memory
+ */
+static inline walk_task *walk_task_new(const char *path, int fd) {
+  walk_task *task;
+
+  if ((task = calloc(1, sizeof(walk_task))) == NULL) {
+    return NULL;
+  }
+  if ((task->path = strdup(path)) == NULL) {
+    free(task);
+    return NULL;
+  }
+  task->fd = fd;
+
+  return task;
+}
+
+static inline void walk_task_free(walk_task *task) {
+  free(task->path);
+  free(task->children);
+  free(task->listing);
+  free(task);
+}
+
+static inline int deque_init(task_deque *deque) {
+  memset(deque, 0, sizeof(task_deque));
+  if ((deque->tasks = malloc(WALK_DEQUE * sizeof(walk_task*))) == NULL) {
+    return -1;
+  }
+  deque->capacity = WALK_DEQUE;
+  pthread_mutex_init(&deque->lock, NULL);
+
+  return 0;
+}
+
+static inline void deque_free(task_deque *deque) {
+  free(deque->tasks);
+  pthread_mutex_destroy(&deque->lock);
+}
+
+/**
+ * Adds a task at the owner's end
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int deque_push(task_deque *deque, walk_task *task) {
+  walk_task **tasks;
+  size_t i;
+  int result = 0;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count == deque->capacity) {
+    if ((tasks = malloc(2 * deque->capacity * sizeof(walk_task*))) == NULL) {
+      result = -1;
+    } else {
+        for (i = 0; i < deque->count; i++) {
+          tasks[i] = deque->tasks[(deque->head + i) & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity *= 2;
+    }
+  }
+
+  if (result == 0) {
+    deque->tasks[(deque->head + deque->count) & (deque->capacity - 1)] =
+      task;
+    deque->count++;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return result;
+}
+
+/**
+ * Takes a task: the newest one for the owner, the oldest one for a thief
+ * @return: the task, or NULL if the deque is empty
+ */
+static inline walk_task *deque_take(task_deque *deque, int steal) {
+  walk_task *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    deque->count--;
+    if (steal) {
+      task = deque->tasks[deque->head];
+      deque->head = (deque->head + 1) & (deque->capacity - 1);
+    } else {
+        task = deque->tasks[(deque->head + deque->count) &
+                            (deque->capacity - 1)];
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return task;
+}
+
+/**
+ * Takes task out of the deque, wherever it is in it
+ * @return: 1 if it was there, 0 if not
+ */
+static inline int deque_remove(task_deque *deque, walk_task *task) {
+  size_t i;
+  int found = 0;
+
+  pthread_mutex_lock(&deque->lock);
+  for (i = 0; i < deque->count && !found; i++) {
+    found = (deque->tasks[(deque->head + i) & (deque->capacity - 1)] == task);
+  }
+  if (found) {
+    // the tasks after it move one place towards the head
+    for (i--; i + 1 < deque->count; i++) {
+      deque->tasks[(deque->head + i) & (deque->capacity - 1)] =
+        deque->tasks[(deque->head + i + 1) & (deque->capacity - 1)];
+    }
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+/**
+ * Called by the lister for each subdirectory of task, in order: makes it
+ * a child task, opening it relative to task->fd while few are open
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int walk_add_child(walk_worker *worker, walk_task *task,
+                                 const char *name) {
+  walk *tree = worker->walk;
+  walk_task **children;
+  walk_task *child;
+  char *path;
+  size_t capacity;
+
+  if (task->num_children == task->children_capacity) {
+    capacity = (task->children_capacity == 0) ? 8
+                                              : 2 * task->children_capacity;
+    if ((children = realloc(task->children, capacity * sizeof(walk_task*)))
+        == NULL) {
+      return -1;
+    }
+    task->children = children;
+    task->children_capacity = capacity;
+  }
+
+  if ((path = malloc(strlen(task->path) + strlen(name) + 2)) == NULL) {
+    return -1;
+  }
+  // "dir/" gives "dir/name", not "dir//name"
+  sprintf(path, "%s%s%s", task->path,
+          (task->path[strlen(task->path) - 1] == '/') ? "" : "/", name);
+  child = walk_task_new(path, -1);
+  free(path);
+  if (child == NULL) {
+    return -1;
+  }
+
+  if (__atomic_add_fetch(&tree->open_fds, 1, __ATOMIC_RELAXED)
+      <= WALK_OPEN_FDS) {
+    child->fd = openat(task->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                       O_CLOEXEC);
+  }
+  if (child->fd == -1) {
+    __atomic_sub_fetch(&tree->open_fds, 1, __ATOMIC_RELAXED);
+  }
+
+  task->children[task->num_children++] = child;
+
+  return 0;
+}
+
+/**
+ * Lists one directory, queues its subdirectories and marks it done
+ */
+static inline void walk_run_task(walk_worker *worker, walk_task *task) {
+  walk *tree = worker->walk;
+  size_t i;
+
+  if (task->fd != -1) {
+    __atomic_sub_fetch(&tree->open_fds, 1, __ATOMIC_RELAXED);
+  } else {
+      task->fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  if (task->fd == -1) {
+    fprintf(stderr, "Cannot open %s\n", task->path);
+  } else {
+      worker->out.used = 0;
+      worker->out.error = 0;
+      tree->lister(worker, task, tree->arg);
+      close(task->fd);
+
+      if ((task->listing = malloc(worker->out.used + 1)) == NULL) {
+        perror(task->path);
+      } else {
+          memcpy(task->listing, worker->out.data, worker->out.used);
+          task->listing_length = worker->out.used;
+      }
+  }
+
+  // the first subdirectory is pushed last, to be the next one taken
+  __atomic_add_fetch(&tree->pending, task->num_children, __ATOMIC_SEQ_CST);
+  for (i = task->num_children; i > 0; i--) {
+    if (deque_push(&worker->deque, task->children[i - 1]) == -1) {
+      // no room to queue it: list it here and now
+      walk_run_task(worker, task->children[i - 1]);
+    } else {
+        __atomic_add_fetch(&tree->queued, 1, __ATOMIC_SEQ_CST);
+    }
+  }
+
+  // wake the threads that wait for work; they count themselves idle
+  // before checking queued, so one of us sees the other
+  if (task->num_children > 0 &&
+      __atomic_load_n(&tree->idle, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&tree->lock);
+    pthread_cond_broadcast(&tree->work);
+    pthread_mutex_unlock(&tree->lock);
+  }
+
+  pthread_mutex_lock(&tree->lock);
+  task->done = 1;
+  __atomic_add_fetch(&tree->held, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&tree->done);
+  if (__atomic_sub_fetch(&tree->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+    pthread_cond_broadcast(&tree->work); // the walk is over
+  }
+  pthread_mutex_unlock(&tree->lock);
+}
+
+/**
+ * Takes the task the output waits for out of the deque it is in
+ * @return: the task, or NULL if there is none or it is taken already
+ */
+static inline walk_task *walk_take_wanted(walk *tree) {
+  walk_task *task;
+  int i;
+
+  pthread_mutex_lock(&tree->lock);
+  task = tree->wanted;
+  tree->wanted = NULL;
+  pthread_mutex_unlock(&tree->lock);
+
+  for (i = 0; task != NULL && i < tree->num_workers; i++) {
+    if (deque_remove(&tree->workers[i].deque, task)) {
+      return task;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Tells whether the threads are as far ahead of the output as they may go
+ */
+static inline int walk_too_far(walk *tree) {
+  return __atomic_load_n(&tree->held, __ATOMIC_SEQ_CST) >= tree->max_held;
+}
+
+/**
+ * The next task of a worker: its own newest, else another's oldest, or
+ * only the one the output waits for when too far ahead of it;
+ * waits while other threads may still queue some
+ * @return: the task, or NULL once every task is done
+ */
+static inline walk_task *walk_next_task(walk_worker *worker) {
+  walk *tree = worker->walk;
+  walk_task *task = NULL;
+  int victim;
+  int i;
+
+  while (1) {
+    if (walk_too_far(tree)) {
+      task = walk_take_wanted(tree);
+    } else {
+        task = deque_take(&worker->deque, 0);
+        for (i = 0,
+             victim = (int) (rand_r(&worker->seed) % tree->num_workers);
+             task == NULL && i < tree->num_workers;
+             i++, victim = (victim + 1) % tree->num_workers) {
+          task = deque_take(&tree->workers[victim].deque, 1);
+        }
+    }
+
+    if (task != NULL) {
+      __atomic_sub_fetch(&tree->queued, 1, __ATOMIC_SEQ_CST);
+      return task;
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    __atomic_add_fetch(&tree->idle, 1, __ATOMIC_SEQ_CST);
+    while ((__atomic_load_n(&tree->queued, __ATOMIC_SEQ_CST) == 0 ||
+            (walk_too_far(tree) && tree->wanted == NULL)) &&
+           __atomic_load_n(&tree->pending, __ATOMIC_SEQ_CST) > 0) {
+      pthread_cond_wait(&tree->work, &tree->lock);
+    }
+    __atomic_sub_fetch(&tree->idle, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&tree->lock);
+
+    if (__atomic_load_n(&tree->pending, __ATOMIC_SEQ_CST) == 0) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Thread routine: runs tasks until the walk is over
+ */
+static void *walk_worker_run(void *data) {
+  walk_worker *worker = (walk_worker*) data;
+  walk_task *task;
+
+  while ((task = walk_next_task(worker)) != NULL) {
+    walk_run_task(worker, task);
+  }
+
+  return NULL;
+}
+
+/**
+ * Writes the listings to output in the order of a serial walk, each as
+ * soon as it is done, and frees the tasks
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int walk_print(walk *tree, walk_task *root, out_buffer *output) {
+  walk_task **stack;
+  walk_task **grown;
+  walk_task *task;
+  size_t depth = 0;
+  size_t capacity = 64;
+  size_t i;
+
+  if ((stack = malloc(capacity * sizeof(walk_task*))) == NULL) {
+    return -1;
+  }
+  stack[depth++] = root;
+
+  while (depth > 0) {
+    task = stack[--depth];
+
+    pthread_mutex_lock(&tree->lock);
+    if (!task->done) {
+      // the threads may be waiting for the output to catch up
+      tree->wanted = task;
+      pthread_cond_broadcast(&tree->work);
+    }
+    while (!task->done) {
+      pthread_cond_wait(&tree->done, &tree->lock);
+    }
+    tree->wanted = NULL;
+    pthread_mutex_unlock(&tree->lock);
+
+    out_bytes(output, task->listing, task->listing_length);
+    if (__atomic_sub_fetch(&tree->held, 1, __ATOMIC_SEQ_CST)
+        == tree->max_held - 1) {
+      pthread_mutex_lock(&tree->lock);
+      pthread_cond_broadcast(&tree->work);
+      pthread_mutex_unlock(&tree->lock);
+    }
+
+    while (depth + task->num_children > capacity) {
+      if ((grown = realloc(stack, 2 * capacity * sizeof(walk_task*)))
+          == NULL) {
+        free(stack);
+        return -1;
+      }
+      stack = grown;
+      capacity *= 2;
+    }
+    for (i = task->num_children; i > 0; i--) {
+      stack[depth++] = task->children[i - 1];
+    }
+    walk_task_free(task);
+  }
+
+  free(stack);
+  return 0;
+}
+
+/**
+ * Lists the tree under the directory open on fd, named path, with
+ * num_threads threads, and writes the listings to output. Each thread
+ * gets a copy of dates, so they all tell recent files the same way.
+ * If no thread can be created the calling thread does the walk.
+ * @return: 0 on success
+ *          -1 if out of memory
+ */
+static inline int walk_tree(const char *path, int fd, int num_threads,
+                            walk_lister lister, void *arg, date_cache *dates,
+                            out_buffer *output) {
+  walk tree;
+  walk_task *root;
+  int started = 0;
+  int ready;
+  int result;
+  int i;
+
+  memset(&tree, 0, sizeof(walk));
+  tree.lister = lister;
+  tree.arg = arg;
+  tree.max_held = WALK_MAX_HELD;
+  pthread_mutex_init(&tree.lock, NULL);
+  pthread_cond_init(&tree.work, NULL);
+  pthread_cond_init(&tree.done, NULL);
+
+  if ((root = walk_task_new(path, fd)) == NULL ||
+      (tree.workers = calloc(num_threads, sizeof(walk_worker))) == NULL) {
+    free(root);
+    return -1;
+  }
+
+  for (ready = 0; ready < num_threads; ready++) {
+    walk_worker *worker = &tree.workers[ready];
+
+    worker->walk = &tree;
+    worker->seed = (unsigned) ready;
+    worker->dates = *dates;
+    if (deque_init(&worker->deque) == -1) {
+      break;
+    } else if (dir_arena_init(&worker->arena) == -1) {
+      deque_free(&worker->deque);
+      break;
+    } else if (out_init(&worker->out, -1) == -1) {
+      dir_arena_free(&worker->arena);
+      deque_free(&worker->deque);
+      break;
+    }
+  }
+  tree.num_workers = ready;
+
+  if (ready == 0) {
+    free(tree.workers);
+    walk_task_free(root);
+    return -1;
+  }
+
+  // the root counts as an open directory waiting in a deque
+  tree.pending = 1;
+  tree.queued = 1;
+  tree.open_fds = 1;
+  deque_push(&tree.workers[0].deque, root);
+
+  for (started = 0; started < ready; started++) {
+    if (pthread_create(&tree.workers[started].thread, NULL, walk_worker_run,
+                       &tree.workers[started]) != 0) {
+      break;
+    }
+  }
+
+  if (started == 0) {
+    // the whole walk is done before the output: nothing to wait for
+    tree.max_held = LONG_MAX;
+    walk_worker_run(&tree.workers[0]);
+  }
+
+  result = walk_print(&tree, root, output);
+
+  for (i = 0; i < started; i++) {
+    pthread_join(tree.workers[i].thread, NULL);
+  }
+
+  for (i = 0; i < ready; i++) {
+    deque_free(&tree.workers[i].deque);
+    dir_arena_free(&tree.workers[i].arena);
+    out_free(&tree.workers[i].out);
+  }
+  free(tree.workers);
+  pthread_mutex_destroy(&tree.lock);
+  pthread_cond_destroy(&tree.work);
+  pthread_cond_destroy(&tree.done);
+
+  return result;
+}
@@ -16,37 +16,52 @@
 #include <dirent.h>
 #include <stdint.h>
 
+#include "ls_copy_v4/id_cache.h"
+#include "ls_copy_v4/date_cache.h"
+#include "ls_copy_v4/key_sort.h"
+
 #define BYTIME 1
 #define BYNAME 2
 #define BYSIZE 3
 #define HERE "."
 #define TRUE 1
 #define FALSE 0
-
-void ls(char dir_name[], int do_long_listing, int sortflag);
+#define MAX_SORT_KEYS 4 // keys given on the command line
+#define MAX_KEY_ARRAYS (2 * MAX_SORT_KEYS + 1) // a time takes two
+
+typedef struct _sort_order {
+  int keys[MAX_SORT_KEYS + 1]; // BYTIME, BYNAME or BYSIZE, first key first,
+                               // then BYNAME if no key given was the name
+  int num_keys;
+  int reverse; // -r, last entry first
+} sort_order;
+
+void ls(char dir_name[], int do_long_listing, sort_order *order);
+int sort_entries(FTSENT **entries, size_t count, sort_order *order,
+                 uint32_t *sorted);
 void print_file_status(char *file_name, struct stat *stat_buffer);
 char* mode_to_string(int mode);
 char* uid_to_name(uid_t uid);
 char* gid_to_name(gid_t gid);
 char* get_date_no_day(time_t time_eval);
 
-int entcmp(const FTSENT **a, const FTSENT **b) {
-  return strcoll((*a)->fts_name, (*b)->fts_name);
-}
-
-int mtimecmp(const FTSENT **s1, const FTSENT **s2) {
-  return (int) (((*s1)->fts_statp)->st_mtime - ((*s2)->fts_statp)->st_mtime);
-}
+// the names of the owners of the files, looked up once per id
+static id_cache users;
+static id_cache groups;
 
-int szcmp(const FTSENT **s1, const FTSENT **s2) {
-  return (int) (((*s1)->fts_statp)->st_size - ((*s2)->fts_statp)->st_size);
-}
+// the days of the modification times, formatted once per day
+static date_cache dates;
 
 int main(int argc, char *argv[]) {
   int long_listing = 0;
-  int howtosort = BYNAME;
+  sort_order order;
+  int preload_ids = FALSE;
   int ch;
-  char options[] = ":lms";
+  int i;
+  char options[] = ":lmnPrs";
+
+  order.num_keys = 0;
+  order.reverse = FALSE;
 
   opterr = 0; // turn off error messages by getopt()
 
@@ -60,20 +75,21 @@ int main(int argc, char *argv[]) {
         long_listing = 1;
         break;
       case 'm': // sort by modification time
-        if (howtosort != BYSIZE) {
-          howtosort = BYTIME;
-        } else {
-          printf("usage: %s [-l] [-m|-s] [files]\n", argv[0]);
-          return 1;
-        }
-        break;
+      case 'n': // sort by name
       case 's': // sort by size
-        if (howtosort != BYTIME) {
-          howtosort = BYSIZE;
-        } else {
-          printf("usage: %s [-l] [-m|-s] [files]\n", argv[0]);
+        // the keys apply in the order given, ties go to the next one
+        if (order.num_keys == MAX_SORT_KEYS) {
+          printf("usage: %s [-lPr] [-m|-n|-s]... [files]\n", argv[0]);
           return 1;
         }
+        order.keys[order.num_keys++] = (ch == 'm') ? BYTIME
+                                     : (ch == 's') ? BYSIZE : BYNAME;
+        break;
+      case 'P': // read all user and group names at the start
+        preload_ids = TRUE;
+        break;
+      case 'r': // reverse the order
+        order.reverse = TRUE;
         break;
       case '?':
         printf("Illegal option ignored.\n");
@@ -84,37 +100,58 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // entries that tie on every key given are sorted by name
+  for (i = 0; i < order.num_keys && order.keys[i] != BYNAME; i++) {
+    ;
+  }
+  if (i == order.num_keys) {
+    order.keys[order.num_keys++] = BYNAME;
+  }
+
+  if (id_cache_init(&users, 0) == -1 || id_cache_init(&groups, 1) == -1) {
+    perror("id_cache_init");
+    return 1;
+  }
+
+  date_cache_init(&dates);
+
+  if (preload_ids && long_listing) {
+    id_cache_preload(&users);
+    id_cache_preload(&groups);
+  }
+
   if (optind == argc) { // no arguments; use .
-    ls(HERE, long_listing, howtosort);
+    ls(HERE, long_listing, &order);
   } else {
       // for each command line argumen, display files
-      while (optind > argc) {
-        ls(argv[optind], long_listing, howtosort);
+      while (optind < argc) {
+        ls(argv[optind], long_listing, &order);
         optind++;
       }
   }
+
+  id_cache_free(&users);
+  id_cache_free(&groups);
   return 0;
 }
 
-void ls(char dir[], int do_long_listing, int sortflag) {
+void ls(char dir[], int do_long_listing, sort_order *order) {
   FTS *tree;
   FTSENT *f;
+  FTSENT *children;
+  FTSENT **entries;
+  uint32_t *sorted;
+  size_t count = 0;
+  size_t i;
   char *argv[] = { dir, NULL };
 
-  switch (sortflag) {
-    case BYTIME:
-      tree = fts_open(argv, FTS_LOGICAL, mtimecmp);
-      break;
-    case BYNAME:
-      tree = fts_open(argv, FTS_LOGICAL, entcmp);
-      break;
-    case BYSIZE:
-      tree = fts_open(argv, FTS_LOGICAL, szcmp);
-      break;
-  }
+  // no comparison function: the entries come in the order of the
+  // directory and are sorted below, on keys computed once
+  tree = fts_open(argv, FTS_LOGICAL, NULL);
 
   if (tree == NULL) {
     perror("fts_open");
+    return;
   }
 
   f = fts_read(tree);
@@ -123,8 +160,8 @@ void ls(char dir[], int do_long_listing, int sortflag) {
     return;
   }
 
-  f = fts_children(tree, 0);
-  if (f == NULL) {
+  children = fts_children(tree, 0);
+  if (children == NULL) {
     if (errno != 0) {
       perror("fts_children");
     } else {
@@ -132,7 +169,29 @@ void ls(char dir[], int do_long_listing, int sortflag) {
     }
   }
 
-  while (f != NULL) {
+  for (f = children; f != NULL; f = f->fts_link) {
+    count++;
+  }
+
+  entries = malloc(count * sizeof(FTSENT*) + 1);
+  sorted = malloc(count * sizeof(uint32_t) + 1);
+  if (entries == NULL || sorted == NULL) {
+    perror("ls");
+    count = 0;
+  }
+
+  for (i = 0, f = children; i < count; i++, f = f->fts_link) {
+    entries[i] = f;
+  }
+
+  if (count > 0 && sort_entries(entries, count, order, sorted) == -1) {
+    perror("sort_entries");
+    count = 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    f = entries[sorted[order->reverse ? count - 1 - i : i]];
+
     switch (f->fts_info) {
       case FTS_DNR: // Cannot read directory
         fprintf(stderr, "Could not read %s\n", f->fts_path);
@@ -154,10 +213,11 @@ void ls(char dir[], int do_long_listing, int sortflag) {
     } else {
       printf("%s\n", f->fts_name);
     }
-
-    f = f->fts_link;
   }
 
+  free(entries);
+  free(sorted);
+
   if (errno != 0) {
     perror("fts_read");
   }
@@ -167,6 +227,81 @@ void ls(char dir[], int do_long_listing, int sortflag) {
   }
 }
 
+/**
+ * Computes the keys of the entries once, one array per key, and sorts
+ * the entries on them (key_sort.h). A modification time is two keys,
+ * seconds then nanoseconds.
+ * @return: 0 on success, with sorted[0] the index of the first entry
+ *          -1 if out of memory
+ */
+int sort_entries(FTSENT **entries, size_t count, sort_order *order,
+                 uint32_t *sorted) {
+  uint64_t *keys[MAX_KEY_ARRAYS];
+  char **names;
+  struct stat *stat_buffer;
+  int num_arrays = 0;
+  int result = 0;
+  int k;
+  size_t i;
+
+  for (k = 0; k < order->num_keys && result == 0; k++) {
+    if ((keys[num_arrays] = malloc(count * sizeof(uint64_t))) == NULL) {
+      result = -1;
+      break;
+    }
+
+    switch (order->keys[k]) {
+      case BYNAME:
+        if ((names = malloc(count * sizeof(char*))) == NULL) {
+          result = -1;
+          break;
+        }
+        for (i = 0; i < count; i++) {
+          names[i] = entries[i]->fts_name;
+        }
+        result = name_ranks(names, count, keys[num_arrays]);
+        free(names);
+        break;
+      case BYSIZE:
+        for (i = 0; i < count; i++) {
+          stat_buffer = entries[i]->fts_statp;
+          keys[num_arrays][i] = (entries[i]->fts_info == FTS_NS) ? 0
+                                : signed_key(stat_buffer->st_size);
+        }
+        break;
+      case BYTIME:
+        if ((keys[num_arrays + 1] = malloc(count * sizeof(uint64_t)))
+            == NULL) {
+          result = -1;
+          break;
+        }
+        for (i = 0; i < count; i++) {
+          stat_buffer = entries[i]->fts_statp;
+          if (entries[i]->fts_info == FTS_NS) {
+            keys[num_arrays][i] = 0;
+            keys[num_arrays + 1][i] = 0;
+          } else {
+            keys[num_arrays][i] = signed_key(stat_buffer->st_mtim.tv_sec);
+            keys[num_arrays + 1][i] = stat_buffer->st_mtim.tv_nsec;
+          }
+        }
+        num_arrays++;
+        break;
+    }
+    num_arrays++;
+  }
+
+  if (result == 0) {
+    result = key_sort(keys, num_arrays, count, sorted);
+  }
+
+  for (k = 0; k < num_arrays; k++) {
+    free(keys[k]);
+  }
+
+  return result;
+}
+
 void print_file_status(char *dir_name, struct stat *stat_buffer) {
   ssize_t count;
   char buffer[NAME_MAX];
@@ -236,64 +371,21 @@ char* mode_to_string(int mode) {
  * Given user-id, return user-name if possible
  */
 char* uid_to_name(uid_t uid) {
-  struct passwd *password_pointer;
-  static char num_string[10]; // must be static!
-  
-  if ((password_pointer = getpwuid(uid)) == NULL) {
-    // convert uid to a string; using sprintf is easier
-    sprintf(num_string, "%d", uid);
-    return num_string;
-  } else {
-      return password_pointer->pw_name;
-  }
+  return id_cache_name(&users, uid);
 }
 
 /**
- * Given group-id, return user-name if possible
+ * Given group-id, return group-name if possible
  */
 char* gid_to_name(gid_t gid) {
-  struct group *group_pointer;
-  static char num_string[10];
-
-  if ((group_pointer = getgrgid(gid)) == NULL) {
-    // convert gid to string
-    sprintf(num_string, "%d", gid);
-    return num_string;
-  } else {
-    return group_pointer->gr_name;
-  }
+  return id_cache_name(&groups, gid);
 }
 
 /**
  * Format the time of the file depending
- * if the file is less than 6 months "%b %e %Y"
- * else "%b %e %H:%M"
+ * if the file is less than 6 months "%b %e %H:%M"
+ * else "%b %e %Y"
  */
 char* get_date_no_day(time_t time_eval) {
-  const int SIX_MONTHS = 15724800; // number of seconds in 6 monthes
-  static char formatted_string[200];
-  struct tm *tmp;
-  time_t current_time = time(NULL);
-  int recent = 1;
-
-  if ((current_time - time_eval) > SIX_MONTHS) {
-    recent = 0;
-  }
-
-  tmp = localtime(&time_eval);
-
-  if (tmp == NULL) {
-    perror("get_date_no_day: localtime");
-  }
-
-  if (!recent) {
-    strftime(formatted_string, sizeof(formatted_string),"%b %e %Y", tmp);
-    return formatted_string;
-  } else if (strftime(formatted_string, sizeof(formatted_string),"%c", tmp) > 0) {
-    return formatted_string + 4;
-  } else {
-      printf("error with strftime\n");
-      strftime(formatted_string, sizeof(formatted_string), "%b %e %H:%M", tmp);
-      return formatted_string;
-  }
+  return date_cache_format(&dates, time_eval);
 }